@@ -32,8 +32,11 @@
 #define SECTSIZE	512
 #define ELFHDR		((struct Elf *) 0x10000) // scratch space
 
-void readsect(void*, uint32_t);
-void readseg(uint32_t, uint32_t, uint32_t);
+// Most sectors one READ SECTORS command can ask for
+#define MAXSECT		256
+
+static void readseg(uint32_t, uint32_t, uint32_t);
+static void waitdisk(void);
 
 
 void
@@ -55,8 +58,12 @@ bootmain(void)
 	// test whether this has written to 0x100000
 	ph = (struct Proghdr *) ((uint8_t *) ELFHDR + ELFHDR->e_phoff);
 	eph = ph + ELFHDR->e_phnum;
-	for (; ph < eph; ph++)
-		readseg(ph->p_pa, ph->p_memsz, ph->p_offset);
+	for (; ph < eph; ph++) {
+		// Only the file image is on the disk; the rest is .bss.
+		readseg(ph->p_pa, ph->p_filesz, ph->p_offset);
+		stosb((void *) (uint32_t) (ph->p_pa + ph->p_filesz), 0,
+		      ph->p_memsz - ph->p_filesz);
+	}
 
 	// call the entry point from the ELF header
 	// note: does not return!
@@ -72,56 +79,48 @@ bad:
 }
 
 // Read 'count' bytes at 'offset' from kernel into physical address 'pa'.
-// Might copy more than asked
-void
+// Might copy more than asked: the whole sectors the bytes are in.
+static void
 readseg(uint32_t pa, uint32_t count, uint32_t offset)
 {
-	uint32_t end_pa;
+	uint32_t nsect, i;
 
-	end_pa = pa + count;
-	uint32_t orgoff = offset;
-	
 	// round down to sector boundary
-	pa &= ~(SECTSIZE - 1);
+	pa -= offset % SECTSIZE;
+	nsect = (offset % SECTSIZE + count + SECTSIZE - 1) / SECTSIZE;
 
-	// translate from bytes to sectors, and kernel starts at sector 3
+	// translate from bytes to sectors, and kernel starts at sector 1
 	offset = (offset / SECTSIZE) + 1;
 
-	// If this is too slow, we could read lots of sectors at a time.
-	// We'd write more to memory than asked, but it doesn't matter --
-	// we load in increasing order.
-	while (pa < end_pa) {
-		readsect((uint8_t*) pa, offset);
+	for (i = 0; i < nsect; i++) {
+		// One command asks for the next MAXSECT sectors, or the rest.
+		if (i % MAXSECT == 0) {
+			// wait for disk to be ready
+			waitdisk();
+
+			outb(0x1F2, MIN(nsect - i, MAXSECT));	// 256 is 0
+			outb(0x1F3, offset);
+			outb(0x1F4, offset >> 8);
+			outb(0x1F5, offset >> 16);
+			outb(0x1F6, (offset >> 24) | 0xE0);
+			outb(0x1F7, 0x20);	// cmd 0x20 - read sectors
+		}
+
+		// wait for the drive to have the sector
+		while ((inb(0x1F7) & 0x88) != 0x08)
+			/* do nothing */;
+
+		// read a sector
+		insl(0x1F0, (void *) pa, SECTSIZE/4);
 		pa += SECTSIZE;
 		offset++;
 	}
 }
 
-void
+static void
 waitdisk(void)
 {
 	// wait for disk reaady
 	while ((inb(0x1F7) & 0xC0) != 0x40)
 		/* do nothing */;
 }
-
-void
-readsect(void *dst, uint32_t offset)
-{
-	// wait for disk to be ready
-	waitdisk();
-
-	outb(0x1F2, 1);		// count = 1
-	outb(0x1F3, offset);
-	outb(0x1F4, offset >> 8);
-	outb(0x1F5, offset >> 16);
-	outb(0x1F6, (offset >> 24) | 0xE0);
-	outb(0x1F7, 0x20);	// cmd 0x20 - read sectors
-
-	// wait for disk to be ready
-	waitdisk();
-
-	// read a sector
-	insl(0x1F0, dst, SECTSIZE/4);
-}
-
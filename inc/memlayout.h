@@ -89,6 +89,11 @@
 // All physical memory mapped at this address
 #define	KERNBASE	0x8004000000
 
+// How much of physical memory bootstrap.S maps at KERNBASE with 2MB
+// pages: the rest of the 1GB region KERNBASE sits in.  The kernel can
+// only touch memory below this until x64_vm_init switches page tables.
+#define BOOTMAPSIZE	(480 * PTSIZE)
+
 // At IOPHYSMEM (640K) there is a 384K hole for I/O.  From the kernel,
 // IOPHYSMEM can be addressed at KERNBASE + IOPHYSMEM.  The hole ends
 // at physical address EXTPHYSMEM
@@ -194,6 +199,28 @@ struct PageInfo {
 	// boot_alloc do not have valid reference count fields.
 
 	uint16_t pp_ref;
+
+	// Buddy allocator state, only meaningful for the first page of a
+	// free block: the block's order (it spans 2^pp_order pages) and
+	// the PP_* flags from kern/pmap.h.
+	uint8_t pp_order;
+	uint8_t pp_flags;
+
+	// For a page used as a PML4: the PCID its address space was given.
+	// It still holds that PCID only while pcid_owner (kern/pmap.c)
+	// names this page.
+	uint16_t pp_pcid;
+
+	union {
+		// Points at whatever points at us on the free list (the list
+		// head or the previous block's pp_link), so a buddy can be
+		// unlinked in O(1) when it is coalesced.  NULL once allocated.
+		struct PageInfo **pp_pprev;
+
+		// For an allocated page holding kmalloc objects: the slab it
+		// is part of (see kern/kmalloc.c).
+		struct Slab *pp_slab;
+	};
 };
 
 #endif /* !__ASSEMBLER__ */
@@ -62,6 +62,8 @@
 #define PTSIZE		(PGSIZE*NPTENTRIES) // bytes mapped by a page directory entry
 #define PTSHIFT		21		// log2(PTSIZE)
 
+#define PDPSIZE		(PTSIZE*NPDENTRIES) // bytes mapped by a page directory pointer entry
+
 #define PTXSHIFT	12		// offset of PTX in a linear address
 #define PDXSHIFT	21		// offset of PDX in a linear address
 #define PDPESHIFT    30
@@ -76,6 +78,7 @@
 #define PTE_A		0x020	// Accessed
 #define PTE_D		0x040	// Dirty
 #define PTE_PS		0x080	// Page Size
+#define PTE_G		0x100	// Global: kept across CR3 loads (with CR4_PGE)
 #define PTE_MBZ		0x180	// Bits must be zero
 
 // The PTE_AVAIL bits aren't used by the kernel or interpreted by the
@@ -104,7 +107,9 @@
 #define CR0_CD		0x40000000	// Cache Disable
 #define CR0_PG		0x80000000	// Paging
 
+#define CR4_PCIDE	0x00020000	// Process-context identifiers
 #define CR4_PCE		0x00000100	// Performance counter enable
+#define CR4_PGE		0x00000080	// Page Global Enable
 #define CR4_MCE		0x00000040	// Machine Check Enable
 #define CR4_PSE		0x00000010	// Page Size Extensions
 #define CR4_DE		0x00000008	// Debugging Extensions
@@ -117,6 +122,24 @@
 #define EFER_MSR    0xC0000080
 #define EFER_LME    8
 
+// With CR4_PCIDE, CR3 holds a 12-bit PCID in its low bits, and a CR3
+// load with CR3_NOFLUSH keeps that PCID's TLB entries.
+#define NPCID		4096
+#define CR3_NOFLUSH	(1ULL << 63)
+
+// INVPCID types
+#define INVPCID_ADDR	0	// one address in one PCID
+#define INVPCID_PCID	1	// everything non-global in one PCID
+
+// CPUID feature flags
+#define CPUID_FEATURES		0x00000001	// leaf: features
+#define CPUID_PCID		(1 << 17)	// (ecx) process-context identifiers
+#define CPUID_STRUCT_EXT	0x00000007	// leaf: structured extended features
+#define CPUID_INVPCID		(1 << 10)	// (ebx) INVPCID instruction
+#define CPUID_EXT_MAX		0x80000000	// leaf: highest extended leaf
+#define CPUID_EXT_FEATURES	0x80000001	// leaf: extended features
+#define CPUID_EXT_PDPE1GB	(1 << 26)	// (edx) 1GB pages
+
 // Eflags register
 #define FL_CF		0x00000001	// Carry Flag
 #define FL_PF		0x00000004	// Parity Flag
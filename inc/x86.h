@@ -11,6 +11,7 @@ static __inline uint16_t inw(int port) __attribute__((always_inline));
 static __inline void insw(int port, void *addr, int cnt) __attribute__((always_inline));
 static __inline uint32_t inl(int port) __attribute__((always_inline));
 static __inline void insl(int port, void *addr, int cnt) __attribute__((always_inline));
+static __inline void stosb(void *addr, int data, int cnt) __attribute__((always_inline));
 static __inline void outb(int port, uint8_t data) __attribute__((always_inline));
 static __inline void outsb(int port, const void *addr, int cnt) __attribute__((always_inline));
 static __inline void outw(int port, uint16_t data) __attribute__((always_inline));
@@ -18,6 +19,7 @@ static __inline void outsw(int port, const void *addr, int cnt) __attribute__((a
 static __inline void outsl(int port, const void *addr, int cnt) __attribute__((always_inline));
 static __inline void outl(int port, uint32_t data) __attribute__((always_inline));
 static __inline void invlpg(void *addr) __attribute__((always_inline));
+static __inline void invpcid(uint64_t type, uint64_t pcid, uint64_t va) __attribute__((always_inline));
 static __inline void lidt(void *p) __attribute__((always_inline));
 static __inline void lgdt(void *p) __attribute__((always_inline));
 static __inline void lldt(uint16_t sel) __attribute__((always_inline));
@@ -94,6 +96,15 @@ insl(int port, void *addr, int cnt)
 			 "memory", "cc");
 }
 
+static __inline void
+stosb(void *addr, int data, int cnt)
+{
+	__asm __volatile("cld\n\trepne\n\tstosb"		:
+			 "=D" (addr), "=c" (cnt)		:
+			 "0" (addr), "1" (cnt), "a" (data)	:
+			 "memory", "cc");
+}
+
 static __inline void
 outb(int port, uint8_t data)
 {
@@ -145,6 +156,14 @@ invlpg(void *addr)
 	__asm __volatile("invlpg (%0)" : : "r" (addr) : "memory");
 }  
 
+static __inline void
+invpcid(uint64_t type, uint64_t pcid, uint64_t va)
+{
+	struct { uint64_t pcid, va; } desc = { pcid, va };
+
+	__asm __volatile("invpcid %0, %1" : : "m" (desc), "r" (type) : "memory");
+}
+
 static __inline void
 lidt(void *p)
 {
@@ -223,7 +242,7 @@ tlbflush(void)
 {
 	uint64_t cr3;
 	__asm __volatile("movq %%cr3,%0" : "=r" (cr3));
-	__asm __volatile("movl %0,%%cr3" : : "r" (cr3));
+	__asm __volatile("movq %0,%%cr3" : : "r" (cr3));
 }
 
 static __inline uint64_t
@@ -263,9 +282,10 @@ static __inline void
 cpuid(uint32_t info, uint32_t *eaxp, uint32_t *ebxp, uint32_t *ecxp, uint32_t *edxp)
 {
 	uint32_t eax, ebx, ecx, edx;
+	// subleaf 0 for the leaves that have subleaves (e.g. 7)
 	asm volatile("cpuid" 
 		: "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx)
-		: "a" (info));
+		: "a" (info), "c" (0));
 	if (eaxp)
 		*eaxp = eax;
 	if (ebxp)
@@ -288,9 +308,9 @@ xchg(volatile uint32_t *addr,uint32_t newval){
 static __inline uint64_t
 read_tsc(void)
 {
-        uint64_t tsc;
-        __asm __volatile("rdtsc" : "=A" (tsc));
-        return tsc;
+        uint32_t lo, hi;
+        __asm __volatile("rdtsc" : "=a" (lo), "=d" (hi));
+        return (uint64_t) hi << 32 | lo;
 }
 
 #endif /* !JOS_INC_X86_H */
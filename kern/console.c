@@ -9,7 +9,6 @@
 #include <kern/console.h>
 
 static void cons_intr(int (*proc)(void));
-static void cons_putc(int c);
 
 // Stupid I/O delay routine necessitated by historical PC design flaws
 static void
@@ -33,6 +32,11 @@ delay(void)
 #define   COM_IER_RDI	0x01	//   Enable receiver data interrupt
 #define COM_IIR		2	// In:	Interrupt ID Register
 #define COM_FCR		2	// Out: FIFO Control Register
+#define   COM_FCR_ENABLE	0x01	//   Enable the FIFOs
+#define   COM_FCR_RCVR_RESET	0x02	//   Clear the receive FIFO
+#define   COM_FCR_XMIT_RESET	0x04	//   Clear the transmit FIFO
+#define   COM_FCR_TRIGGER_14	0xC0	//   Receive interrupt at 14 bytes
+#define   COM_IIR_FIFO	0xC0	//   In IIR: FIFOs enabled (16550A)
 #define COM_LCR		3	// Out: Line Control Register
 #define	  COM_LCR_DLAB	0x80	//   Divisor latch access bit
 #define	  COM_LCR_WLEN8	0x03	//   Wordlength: 8 bits
@@ -45,7 +49,18 @@ delay(void)
 #define   COM_LSR_TXRDY	0x20	//   Transmit buffer avail
 #define   COM_LSR_TSRE	0x40	//   Transmitter off
 
+#define COM_FREQ	115200	// Divisor latch input: 1.8432 MHz / 16
+#define COM_FIFO_SIZE	16	// Transmit FIFO depth of a 16550A
+
+// Line speed serial_init programs; build with -DCOM_BAUD=n to change
+// it, or call serial_set_baud later.
+#ifndef COM_BAUD
+#define COM_BAUD	115200
+#endif
+
 static bool serial_exists;
+static int serial_fifo;		// bytes the transmitter holds: 16 or 1
+static int serial_tx_room;	// bytes we may send before polling LSR
 
 static int
 serial_proc_data(void)
@@ -55,6 +70,19 @@ serial_proc_data(void)
 	return inb(COM1+COM_RX);
 }
 
+// Wait until the UART has put everything it was given on the wire.
+void
+serial_flush(void)
+{
+	int i;
+
+	if (!serial_exists)
+		return;
+	for (i = 0; !(inb(COM1 + COM_LSR) & COM_LSR_TSRE) && i < 12800; i++)
+		delay();
+	serial_tx_room = 0;
+}
+
 void
 serial_intr(void)
 {
@@ -62,32 +90,67 @@ serial_intr(void)
 		cons_intr(serial_proc_data);
 }
 
+// Once LSR says the transmitter is empty, the whole FIFO is ours: send
+// up to serial_fifo bytes before polling again.
 static void
-serial_putc(int c)
+serial_write(const char *s, size_t n)
 {
 	int i;
 
-	for (i = 0;
-	     !(inb(COM1 + COM_LSR) & COM_LSR_TXRDY) && i < 12800;
-	     i++)
-		delay();
-
-	outb(COM1 + COM_TX, c);
+	if (!serial_exists)
+		return;
+
+	while (n > 0) {
+		if (serial_tx_room == 0) {
+			for (i = 0;
+			     !(inb(COM1 + COM_LSR) & COM_LSR_TXRDY) && i < 12800;
+			     i++)
+				delay();
+			serial_tx_room = serial_fifo;
+		}
+		for (; serial_tx_room > 0 && n > 0; serial_tx_room--, n--)
+			outb(COM1 + COM_TX, *s++);
+	}
 }
 
-static void
-serial_init(void)
+// Set the line speed.  Returns -1 if the UART can't run at 'baud'.
+int
+serial_set_baud(unsigned baud)
 {
-	// Turn off the FIFO
-	outb(COM1+COM_FCR, 0);
+	unsigned div;
+
+	if (baud == 0 || COM_FREQ % baud != 0)
+		return -1;
+	div = COM_FREQ / baud;
+
+	// Let what was sent go out at the old speed.
+	serial_flush();
 
 	// Set speed; requires DLAB latch
 	outb(COM1+COM_LCR, COM_LCR_DLAB);
-	outb(COM1+COM_DLL, (uint8_t) (115200 / 9600));
-	outb(COM1+COM_DLM, 0);
+	outb(COM1+COM_DLL, (uint8_t) div);
+	outb(COM1+COM_DLM, (uint8_t) (div >> 8));
 
 	// 8 data bits, 1 stop bit, parity off; turn off DLAB latch
 	outb(COM1+COM_LCR, COM_LCR_WLEN8 & ~COM_LCR_DLAB);
+	return 0;
+}
+
+static void
+serial_init(void)
+{
+	// Turn on and clear the FIFOs; a 16550A says so in IIR, an
+	// older UART has a one-byte transmit buffer.
+	outb(COM1+COM_FCR, COM_FCR_ENABLE | COM_FCR_RCVR_RESET
+	     | COM_FCR_XMIT_RESET | COM_FCR_TRIGGER_14);
+	if ((inb(COM1+COM_IIR) & COM_IIR_FIFO) == COM_IIR_FIFO)
+		serial_fifo = COM_FIFO_SIZE;
+	else {
+		outb(COM1+COM_FCR, 0);
+		serial_fifo = 1;
+	}
+
+	serial_set_baud(COM_BAUD);
 
 	// No modem controls
 	outb(COM1+COM_MCR, 0);
@@ -108,16 +171,54 @@ serial_init(void)
 // For information on PC parallel port programming, see the class References
 // page.
 
+#define LPT1		0x378
+
+#define LPT_DATA	0	// In/Out: data latch
+#define LPT_STATUS	1	// In:	Status Register
+#define   LPT_STATUS_BUSY	0x80	//   Printer not busy (active low)
+#define LPT_CTRL	2	// Out: Control Register
+#define   LPT_CTRL_STROBE	0x01	//   Strobe
+#define   LPT_CTRL_INIT	0x04	//   Don't reset the printer
+#define   LPT_CTRL_SELECT	0x08	//   Select the printer
+
+static bool lpt_exists;
+
+// A port is there if its data latch reads back what we wrote to it;
+// an empty ISA address reads as 0xFF whatever was written.
+static void
+lpt_init(void)
+{
+	outb(LPT1 + LPT_DATA, 0xAA);
+	lpt_exists = (inb(LPT1 + LPT_DATA) == 0xAA);
+	outb(LPT1 + LPT_DATA, 0x55);
+	lpt_exists = lpt_exists && (inb(LPT1 + LPT_DATA) == 0x55);
+}
+
 static void
 lpt_putc(int c)
 {
 	int i;
 
-	for (i = 0; !(inb(0x378+1) & 0x80) && i < 12800; i++)
+	for (i = 0; !(inb(LPT1 + LPT_STATUS) & LPT_STATUS_BUSY) && i < 12800; i++)
 		delay();
-	outb(0x378+0, c);
-	outb(0x378+2, 0x08|0x04|0x01);
-	outb(0x378+2, 0x08);
+	if (i == 12800) {
+		// Nothing is taking bytes off the port: don't wait for
+		// it on every character from now on.
+		lpt_exists = 0;
+		return;
+	}
+	outb(LPT1 + LPT_DATA, c);
+	outb(LPT1 + LPT_CTRL, LPT_CTRL_SELECT | LPT_CTRL_INIT | LPT_CTRL_STROBE);
+	outb(LPT1 + LPT_CTRL, LPT_CTRL_SELECT);
+}
+
+static void
+lpt_write(const char *s, size_t n)
+{
+	// The port takes one byte per strobe; give up early if it
+	// stops responding partway.
+	while (n-- > 0 && lpt_exists)
+		lpt_putc(*s++);
 }
 
 
@@ -125,9 +226,40 @@ lpt_putc(int c)
 
 /***** Text-mode CGA/VGA display output *****/
 
+// The screen is a CRT_SIZE window into the text memory at crt_buf,
+// starting at cell crt_start.  Scrolling just moves the window down a
+// line by reprogramming the 6845's start address; only when it runs
+// off the end of text memory is the screen copied back to the start.
 static unsigned addr_6845;
 static uint16_t *crt_buf;
-static uint16_t crt_pos;
+static uint16_t crt_vram;	// cells of text memory at crt_buf
+static uint16_t crt_start;	// first cell on the screen
+static uint16_t crt_pos;	// where the next character goes
+static uint16_t crt_shown_start;	// what the 6845 was last told
+static uint16_t crt_shown_pos;
+
+// Lines that have scrolled off the top of the screen.  crt_hist_count
+// counts every line ever saved; the last CRT_HISTLINES are kept.
+#define CRT_HISTLINES	256
+
+static uint16_t crt_hist[CRT_HISTLINES][CRT_COLS];
+static uint32_t crt_hist_count;
+
+// While the monitor pages back through the history, crt_view is how
+// many lines back the screen shows, and crt_saved holds the live
+// screen underneath it.
+static int crt_view;
+static uint16_t crt_saved[CRT_SIZE];
+
+// Load a pair of 6845 registers (start address 12/13, cursor 14/15).
+static void
+crt_set(int reg, uint16_t val)
+{
+	outb(addr_6845, reg);
+	outb(addr_6845 + 1, val >> 8);
+	outb(addr_6845, reg + 1);
+	outb(addr_6845 + 1, val);
+}
 
 static void
 cga_init(void)
@@ -142,9 +274,11 @@ cga_init(void)
 	if (*cp != 0xA55A) {
 		cp = (uint16_t*) (KERNBASE + MONO_BUF);
 		addr_6845 = MONO_BASE;
+		crt_vram = MONO_VRAM;
 	} else {
 		*cp = was;
 		addr_6845 = CGA_BASE;
+		crt_vram = CGA_VRAM;
 	}
 
 	/* Extract cursor location */
@@ -155,6 +289,32 @@ cga_init(void)
 
 	crt_buf = (uint16_t*) cp;
 	crt_pos = pos;
+
+	// The BIOS may have scrolled with the start address too.
+	crt_start = crt_shown_start = 0;
+	crt_shown_pos = crt_pos;
+	crt_set(12, crt_start);
+}
+
+// Move the screen down a line, saving the top line in the history.
+static void
+cga_scroll(void)
+{
+	int i;
+
+	memmove(crt_hist[crt_hist_count++ % CRT_HISTLINES], crt_buf + crt_start,
+		CRT_COLS * sizeof(uint16_t));
+
+	if (crt_start + CRT_COLS + CRT_SIZE <= crt_vram)
+		crt_start += CRT_COLS;
+	else {
+		memmove(crt_buf, crt_buf + crt_start + CRT_COLS,
+			(CRT_SIZE - CRT_COLS) * sizeof(uint16_t));
+		crt_pos -= crt_start + CRT_COLS;
+		crt_start = 0;
+	}
+	for (i = crt_start + CRT_SIZE - CRT_COLS; i < crt_start + CRT_SIZE; i++)
+		crt_buf[i] = 0x0700 | ' ';
 }
 
 
@@ -162,15 +322,14 @@ cga_init(void)
 static void
 cga_putc(int c)
 {
-	// if no attribute given, then use black on white
-	if (!(c & ~0xFF))
-		c |= 0x0700;
+	// Console output is plain bytes, always white on black.
+	c = 0x0700 | (c & 0xff);
 
 	switch (c & 0xff) {
 	case '\b':
-		if (crt_pos > 0) {
+		if (crt_pos > crt_start) {
 			crt_pos--;
-			crt_buf[crt_pos] = (c & ~0xff) | ' ';
+			crt_buf[crt_pos] = 0x0700 | ' ';
 		}
 		break;
 	case '\n':
@@ -180,32 +339,73 @@ cga_putc(int c)
 		crt_pos -= (crt_pos % CRT_COLS);
 		break;
 	case '\t':
-		cons_putc(' ');
-		cons_putc(' ');
-		cons_putc(' ');
-		cons_putc(' ');
-		cons_putc(' ');
+		cga_putc(' ');
+		cga_putc(' ');
+		cga_putc(' ');
+		cga_putc(' ');
+		cga_putc(' ');
 		break;
 	default:
 		crt_buf[crt_pos++] = c;		/* write the character */
 		break;
 	}
 
-	// What is the purpose of this?
-	if (crt_pos >= CRT_SIZE) {
-		int i;
+	if (crt_pos >= crt_start + CRT_SIZE)
+		cga_scroll();
+}
 
-		memmove(crt_buf, crt_buf + CRT_COLS, (CRT_SIZE - CRT_COLS) * sizeof(uint16_t));
-		for (i = CRT_SIZE - CRT_COLS; i < CRT_SIZE; i++)
-			crt_buf[i] = 0x0700 | ' ';
-		crt_pos -= CRT_COLS;
+// Show the screen as it was 'back' lines ago, or the live screen if
+// 'back' is 0.  Returns how far back it went, which is at most the
+// number of lines in the history.
+int
+cga_scrollback(int back)
+{
+	uint32_t nhist = MIN(crt_hist_count, CRT_HISTLINES);
+	uint32_t line;
+	int row;
+
+	if (!crt_buf)
+		return 0;
+	back = MAX(0, MIN(back, (int) nhist));
+	if (back == crt_view)
+		return back;
+
+	if (crt_view == 0)
+		memmove(crt_saved, crt_buf + crt_start, sizeof(crt_saved));
+	for (row = 0; row < CRT_ROWS; row++) {
+		line = nhist - back + row;
+		memmove(crt_buf + crt_start + row * CRT_COLS,
+			line < nhist
+			? crt_hist[(crt_hist_count - nhist + line) % CRT_HISTLINES]
+			: crt_saved + (line - nhist) * CRT_COLS,
+			CRT_COLS * sizeof(uint16_t));
 	}
 
-	/* move that little blinky thing */
-	outb(addr_6845, 14);
-	outb(addr_6845 + 1, crt_pos >> 8);
-	outb(addr_6845, 15);
-	outb(addr_6845 + 1, crt_pos);
+	// Park the cursor off the screen while looking back.
+	crt_shown_pos = back ? crt_start + CRT_SIZE : crt_pos;
+	crt_set(14, crt_shown_pos);
+	crt_view = back;
+	return back;
+}
+
+static void
+cga_write(const char *s, size_t n)
+{
+	if (crt_view)
+		cga_scrollback(0);
+
+	while (n-- > 0)
+		cga_putc((unsigned char) *s++);
+
+	/* move the screen and that little blinky thing, once per write */
+	if (crt_start != crt_shown_start) {
+		crt_set(12, crt_start);
+		crt_shown_start = crt_start;
+	}
+	if (crt_pos != crt_shown_pos) {
+		crt_set(14, crt_pos);
+		crt_shown_pos = crt_pos;
+	}
 }
 
 
@@ -424,13 +624,143 @@ cons_getc(void)
 	return 0;
 }
 
-// output a character to the console
+// The devices console output goes to.  A backend is written to only
+// while it is both present and enabled; 'console' in the monitor turns
+// them on and off.
+struct cons_backend {
+	const char *name;
+	bool *present;		// NULL if always there
+	void (*write)(const char *s, size_t n);
+	bool enabled;
+	uint64_t bytes;		// bytes written
+	uint64_t cycles;	// TSC cycles spent in write
+};
+
+static bool cga_exists = 1;
+
+static struct cons_backend cons_backends[] = {
+	{ "serial", &serial_exists, serial_write },
+	{ "lpt", &lpt_exists, lpt_write },
+	{ "cga", &cga_exists, cga_write },
+};
+#define NCONS_BACKENDS	(sizeof(cons_backends) / sizeof(cons_backends[0]))
+
+// Which backends cons_init enables, as a comma-separated list of names.
+// Our boot loader passes no command line, so this build-time default
+// and the monitor's 'console' command are the only ways to choose.
+#ifndef CONS_DEFAULT
+#define CONS_DEFAULT	"serial,lpt,cga"
+#endif
+
+static struct cons_backend *
+cons_backend_lookup(const char *name, size_t len)
+{
+	int i;
+
+	for (i = 0; i < NCONS_BACKENDS; i++)
+		if (strlen(cons_backends[i].name) == len
+		    && strncmp(cons_backends[i].name, name, len) == 0)
+			return &cons_backends[i];
+	return NULL;
+}
+
+static bool
+cons_backend_present(struct cons_backend *cb)
+{
+	return !cb->present || *cb->present;
+}
+
+// Turn a backend on or off.  Returns 0 on success, or -1 if there is
+// no such backend, it is absent, or it is the last one still enabled.
+int
+cons_backend_enable(const char *name, bool on)
+{
+	struct cons_backend *cb;
+	int i, n;
+
+	if (!(cb = cons_backend_lookup(name, strlen(name))))
+		return -1;
+	if (on) {
+		if (!cons_backend_present(cb))
+			return -1;
+	} else if (cb->enabled) {
+		for (i = n = 0; i < NCONS_BACKENDS; i++)
+			n += cons_backends[i].enabled
+			     && cons_backend_present(&cons_backends[i]);
+		if (n == 1)
+			return -1;
+	}
+	cb->enabled = on;
+	return 0;
+}
+
+// Enable exactly the backends named in 'list' ("serial,cga"), which
+// ends at a NUL or a space.  Leaves things alone if it names none.
 static void
-cons_putc(int c)
+cons_backend_select(const char *list)
 {
-	serial_putc(c);
-	lpt_putc(c);
-	cga_putc(c);
+	struct cons_backend *cb;
+	bool want[NCONS_BACKENDS];
+	const char *p;
+	int i, n;
+
+	memset(want, 0, sizeof(want));
+	for (n = 0; *list && *list != ' '; list = p) {
+		for (p = list; *p && *p != ' ' && *p != ','; p++)
+			/* do nothing */;
+		if ((cb = cons_backend_lookup(list, p - list))) {
+			want[cb - cons_backends] = 1;
+			n++;
+		}
+		if (*p == ',')
+			p++;
+	}
+	if (n > 0)
+		for (i = 0; i < NCONS_BACKENDS; i++)
+			cons_backends[i].enabled = want[i];
+}
+
+// output n bytes to the console, handing each backend the whole span
+void
+cons_write(const char *s, size_t n)
+{
+	struct cons_backend *cb;
+	uint64_t t;
+
+	if (n == 0)
+		return;
+	for (cb = cons_backends; cb < cons_backends + NCONS_BACKENDS; cb++) {
+		if (!cb->enabled || !cons_backend_present(cb))
+			continue;
+		t = read_tsc();
+		cb->write(s, n);
+		cb->cycles += read_tsc() - t;
+		cb->bytes += n;
+	}
+}
+
+// wait until output written so far has left the devices
+void
+cons_flush(void)
+{
+	serial_flush();
+}
+
+void
+cons_print_stats(void)
+{
+	struct cons_backend *cb;
+
+	cprintf("backend  state     bytes       cycles  cycles/byte\n");
+	for (cb = cons_backends; cb < cons_backends + NCONS_BACKENDS; cb++)
+		cprintf("%-8s %-8s %6ld %12ld %12ld\n", cb->name,
+			!cons_backend_present(cb) ? "absent"
+			: cb->enabled ? "on" : "off",
+			cb->bytes, cb->cycles,
+			cb->bytes ? cb->cycles / cb->bytes : 0);
+	cprintf("serial: %d-byte FIFO\n", serial_fifo);
+	cprintf("cga: %d-cell text memory, %d lines scrolled, %d kept\n",
+		crt_vram, crt_hist_count, MIN(crt_hist_count, CRT_HISTLINES));
 }
 
 // initialize the console devices
@@ -440,6 +770,9 @@ cons_init(void)
 	cga_init();
 	kbd_init();
 	serial_init();
+	lpt_init();
+
+	cons_backend_select(CONS_DEFAULT);
 
 	if (!serial_exists)
 		cprintf("Serial port does not exist!\n");
@@ -448,10 +781,14 @@ cons_init(void)
 
 // `High'-level console I/O.  Used by readline and cprintf.
 
+// Write the byte 'c' to the console.  Only the low 8 bits count; there
+// is no way to pass a CGA color attribute through.
 void
 cputchar(int c)
 {
-	cons_putc(c);
+	char ch = c;
+
+	cons_write(&ch, 1);
 }
 
 int
@@ -17,8 +17,18 @@
 #define CRT_COLS	80
 #define CRT_SIZE	(CRT_ROWS * CRT_COLS)
 
+// Cells of text memory the display can scroll through
+#define MONO_VRAM	(4096 / 2)
+#define CGA_VRAM	(32768 / 2)
+
 void cons_init(void);
 int cons_getc(void);
+void cons_write(const char *s, size_t n);
+void cons_flush(void);
+void cons_print_stats(void);
+int cons_backend_enable(const char *name, bool on);
+int cga_scrollback(int back);
+int serial_set_baud(unsigned baud);
 
 void kbd_intr(void); // irq 1
 void serial_intr(void); // irq 4
@@ -0,0 +1,23 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_INC_CPU_H
+#define JOS_INC_CPU_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+// Maximum number of CPUs; memlayout.h reserves a kernel stack below
+// KSTACKTOP for each of them.
+#define NCPU	8
+
+// The ID of the CPU we are running on.  Until the local APIC is brought
+// up JOS only runs on the boot CPU, which is always CPU 0.
+static inline int
+cpunum(void)
+{
+	return 0;
+}
+
+#endif
@@ -268,6 +268,7 @@ typedef struct _Dwarf_LineInfo_ {
     //STAILQ_HEAD(, _Dwarf_LineFile) li_lflist; /* List of files. */
     _Dwarf_Line  li_line;    /* Array of lines. */
     Dwarf_Unsigned  li_lnlen;   /* Length of the line array. */
+    struct _Dwarf_LineTable *li_table; /* If set, collect all rows here. */
     //STAILQ_HEAD(, _Dwarf_Line) li_lnlist; /* List of lines. */
 }_Dwarf_LineInfo;
 
@@ -275,5 +276,14 @@ typedef _Dwarf_LineInfo  *Dwarf_LineInfo;
 typedef _Dwarf_Line     *Dwarf_Line;
 
 int dwarf_srclines(Dwarf_Die *die, Dwarf_Line linebuf, Dwarf_Addr pc, Dwarf_Error *error);
+int dwarf_init_eh_section(Dwarf_Debug dbg, Dwarf_Error *error);
+int dwarf_get_fde_at_pc(Dwarf_Addr pc, Dwarf_Addr *lopc, Dwarf_Addr *hipc,
+    struct _Dwarf_Fde *ret_fde, Dwarf_Cie cie, Dwarf_Error *error);
+int dwarf_get_fde_info_for_all_regs3(Dwarf_Fde fde, Dwarf_Addr pc_requested,
+    Dwarf_Regtable3 *reg_table, Dwarf_Addr *row_pc, Dwarf_Addr *row_end,
+    Dwarf_Error *error);
+int dwarf_srclines_range(Dwarf_Die *die, Dwarf_Addr lo, Dwarf_Addr hi,
+    Dwarf_Line linebuf, Dwarf_Unsigned maxlines, Dwarf_Unsigned *nlines,
+    Dwarf_Error *error);
 
 #endif
@@ -4,6 +4,9 @@
 
 extern uintptr_t read_section_headers(uintptr_t, uintptr_t);
 extern void find_debug_sections(uintptr_t);
+extern void ide_dma_init(void);
+extern void debug_sect_bench(void);
+extern uint64_t debug_sect_deferred, debug_sect_loaded, debug_sect_load_tsc;
 extern int dwarf_get_pc_info(uintptr_t addr, struct Ripdebuginfo *info);
 
 #endif
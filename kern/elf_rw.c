@@ -7,6 +7,7 @@
 #include "dwarf.h"
 
 #include <kern/pmap.h>
+#include <kern/pci.h>
 
 #define SECTSIZE	512
 #define OFFSET_CORRECT(x) (x - ROUNDDOWN(x, SECTSIZE))
@@ -18,6 +19,8 @@ enum {
 	DEBUG_FRAME,
 	DEBUG_LINE,
 	DEBUG_STR,
+	DEBUG_ARANGES,
+	DEBUG_FRAME_HDR,
 	NDEBUG_SECT,
 };
 
@@ -27,18 +30,74 @@ Dwarf_Section section_info[NDEBUG_SECT] = {
 	{.ds_name=".eh_frame", .ds_data=NULL, .ds_addr=0, .ds_size=0},
     {.ds_name=".debug_line", .ds_data=NULL, .ds_addr=0, .ds_size=0},
 	{.ds_name=".debug_str", .ds_data=NULL, .ds_addr=0, .ds_size=0},
+	{.ds_name=".debug_aranges", .ds_data=NULL, .ds_addr=0, .ds_size=0},
+	{.ds_name=".eh_frame_hdr", .ds_data=NULL, .ds_addr=0, .ds_size=0},
 };
 
+// IDE status bits and commands
+#define IDE_BSY		0x80
+#define IDE_DF		0x20
+#define IDE_DRQ		0x08
+#define IDE_ERR		0x01
+
+#define IDE_CMD_READ		0x20
+#define IDE_CMD_READMULT	0xC4
+#define IDE_CMD_READDMA		0xC8
+#define IDE_CMD_SETMULT		0xC6
+#define IDE_CMD_IDENTIFY	0xEC
+
+// Most sectors one READ SECTORS command can ask for
+#define IDE_MAXSECT	256
+
+// Device control register; nIEN keeps the drive from raising IRQ 14
+#define IDE_CTL		0x3F6
+#define IDE_CTL_NIEN	0x02
+
+// Bus-master IDE registers for the primary channel, from the base in
+// the controller's BAR4
+#define BM_CMD		0
+#define BM_STATUS	2
+#define BM_PRDT		4
+
+#define BM_CMD_START		0x01
+#define BM_CMD_READ		0x08	// device to memory
+#define BM_STATUS_ACTIVE	0x01
+#define BM_STATUS_ERR		0x02
+#define BM_STATUS_INT		0x04
+
 void readsect(void*, uint64_t);
+int readsects(void*, uint64_t, int);
 void readseg(uint64_t, uint64_t, uint64_t, uint64_t*);
 
 uintptr_t
 read_section_headers(uintptr_t, uintptr_t);
 
+// Where read_section_headers reserved room for each debug section that
+// is read off the disk, and where on the disk the section is.  A
+// section is pending until _dwarf_find_section first reads it in.
+static char *section_dst[NDEBUG_SECT];
+static uint64_t section_diskoff[NDEBUG_SECT];
+static bool section_pending[NDEBUG_SECT];
+
+// Bytes of debug sections not read at boot, and the cycles spent
+// reading sections in on demand since.
+uint64_t debug_sect_deferred;
+uint64_t debug_sect_loaded;
+uint64_t debug_sect_load_tsc;
+
+// How many bytes readseg writes when asked for 'count' bytes at
+// 'offset'.
+static uint64_t
+readseg_span(uint64_t count, uint64_t offset)
+{
+	return ROUNDUP(offset % SECTSIZE + count, SECTSIZE);
+}
+
 Dwarf_Section *
 _dwarf_find_section(const char *name)
 {
     Dwarf_Section *ret=NULL;
+    uint64_t kvoffset = 0, tsc;
     int i;
 
     for(i=0; i < NDEBUG_SECT; i++) {
@@ -48,6 +107,15 @@ _dwarf_find_section(const char *name)
         }
     }
 
+    if (ret && section_pending[i]) {
+	    tsc = read_tsc();
+	    readseg((uint64_t)section_dst[i], ret->ds_size,
+		    section_diskoff[i], &kvoffset);
+	    debug_sect_load_tsc += read_tsc() - tsc;
+	    debug_sect_loaded += ret->ds_size;
+	    section_pending[i] = 0;
+    }
+
     return ret;
 }
 
@@ -80,11 +148,20 @@ void find_debug_sections(uintptr_t elf)
 			section_info[DEBUG_FRAME].ds_addr = sh->sh_addr;
 			section_info[DEBUG_FRAME].ds_size = sh->sh_size;
             debug_address += sh->sh_size;
+        } else if(!strcmp(name, ".eh_frame_hdr")){
+            section_info[DEBUG_FRAME_HDR].ds_data = (uint8_t*)sh->sh_addr;
+			section_info[DEBUG_FRAME_HDR].ds_addr = sh->sh_addr;
+			section_info[DEBUG_FRAME_HDR].ds_size = sh->sh_size;
         } else if(!strcmp(name, ".debug_str")) {
             section_info[DEBUG_STR].ds_data = (uint8_t*)debug_address;
 			section_info[DEBUG_STR].ds_addr = debug_address;
 			section_info[DEBUG_STR].ds_size = sh->sh_size;
             debug_address += sh->sh_size;
+        } else if(!strcmp(name, ".debug_aranges")) {
+            section_info[DEBUG_ARANGES].ds_data = (uint8_t*)debug_address;
+			section_info[DEBUG_ARANGES].ds_addr = debug_address;
+			section_info[DEBUG_ARANGES].ds_size = sh->sh_size;
+            debug_address += sh->sh_size;
         }
     }
 
@@ -93,7 +170,7 @@ void find_debug_sections(uintptr_t elf)
 uint64_t
 read_section_headers(uintptr_t elfhdr, uintptr_t to_va)
 {
-    Secthdr* secthdr_ptr[20] = {0};
+    Secthdr *sh;
     char* kvbase = ROUNDUP((char*)to_va, SECTSIZE);
     uint64_t kvoffset = 0;
 	char *orig_secthdr = (char*)kvbase;
@@ -110,6 +187,7 @@ read_section_headers(uintptr_t elfhdr, uintptr_t to_va)
 	int i;
 	uint64_t temp;
 	char *name;
+	int j;
 
 	Elf *ehdr = (Elf *)elfhdr;
 	Secthdr *sec_name;  
@@ -117,12 +195,9 @@ read_section_headers(uintptr_t elfhdr, uintptr_t to_va)
 	readseg((uint64_t)orig_secthdr , numSectionHeaders * sizeSections,
              offset, &kvoffset);
 	secthdr = (char*)orig_secthdr + (offset - ROUNDDOWN(offset, SECTSIZE));
-	for (i = 0; i < numSectionHeaders; i++)
-	{
-		 secthdr_ptr[i] = (Secthdr*)(secthdr) + i;
-	}
+	sh = (Secthdr*)secthdr;
 	
-	sec_name = secthdr_ptr[ehdr->e_shstrndx]; 
+	sec_name = &sh[ehdr->e_shstrndx]; 
 	temp = kvoffset;
 	readseg((uint64_t)((char *)kvbase + kvoffset), sec_name->sh_size,
             sec_name->sh_offset, &kvoffset);
@@ -131,86 +206,61 @@ read_section_headers(uintptr_t elfhdr, uintptr_t to_va)
     
 	for (i = 0; i < numSectionHeaders; i++)
     {
-		name = (char *)(nametab + secthdr_ptr[i]->sh_name);
+		name = (char *)(nametab + sh[i].sh_name);
         assert(kvoffset % SECTSIZE == 0);
-        temp = kvoffset;
 #ifdef DWARF_DEBUG
         cprintf("SectName: %s\n", name);
 #endif
-		if(!strcmp(name, ".debug_info"))
-		{
-			readseg((uint64_t)((char *)kvbase + kvoffset), secthdr_ptr[i]->sh_size, 
-                    secthdr_ptr[i]->sh_offset, &kvoffset);	
-			section_info[DEBUG_INFO].ds_data = (uint8_t *)((char *)kvbase + temp) + OFFSET_CORRECT(secthdr_ptr[i]->sh_offset);
-			section_info[DEBUG_INFO].ds_addr = (uintptr_t)section_info[DEBUG_INFO].ds_data;
-			section_info[DEBUG_INFO].ds_size = secthdr_ptr[i]->sh_size;
-		}
-		else if(!strcmp(name, ".debug_abbrev"))
-		{
-			readseg((uint64_t)((char *)kvbase + kvoffset), secthdr_ptr[i]->sh_size, 
-                    secthdr_ptr[i]->sh_offset, &kvoffset);	
-			section_info[DEBUG_ABBREV].ds_data = (uint8_t *)((char *)kvbase + temp) + OFFSET_CORRECT(secthdr_ptr[i]->sh_offset);
-			section_info[DEBUG_ABBREV].ds_addr = (uintptr_t)section_info[DEBUG_ABBREV].ds_data;
-			section_info[DEBUG_ABBREV].ds_size = secthdr_ptr[i]->sh_size;
-		}
-		else if(!strcmp(name, ".debug_line"))
-		{
-			readseg((uint64_t)((char *)kvbase + kvoffset), secthdr_ptr[i]->sh_size, 
-                    secthdr_ptr[i]->sh_offset, &kvoffset);	
-			section_info[DEBUG_LINE].ds_data = (uint8_t *)((char *)kvbase + temp) + OFFSET_CORRECT(secthdr_ptr[i]->sh_offset);
-			section_info[DEBUG_LINE].ds_addr = (uintptr_t)section_info[DEBUG_LINE].ds_data;
-			section_info[DEBUG_LINE].ds_size = secthdr_ptr[i]->sh_size;
-		}
-		else if(!strcmp(name, ".eh_frame"))
-		{
-			section_info[DEBUG_FRAME].ds_data = (uint8_t *)secthdr_ptr[i]->sh_addr;
-			section_info[DEBUG_FRAME].ds_addr = (uintptr_t)section_info[DEBUG_FRAME].ds_data;
-			section_info[DEBUG_FRAME].ds_size = secthdr_ptr[i]->sh_size;
-		}
-		else if(!strcmp(name, ".debug_str"))
-		{
-			readseg((uint64_t)((char *)kvbase + kvoffset), secthdr_ptr[i]->sh_size, 
-                    secthdr_ptr[i]->sh_offset, &kvoffset);	
-			section_info[DEBUG_STR].ds_data = (uint8_t *)((char *)kvbase + temp) + OFFSET_CORRECT(secthdr_ptr[i]->sh_offset);
-			section_info[DEBUG_STR].ds_addr = (uintptr_t)section_info[DEBUG_STR].ds_data;
-			section_info[DEBUG_STR].ds_size = secthdr_ptr[i]->sh_size;
+		for (j = 0; j < NDEBUG_SECT; j++)
+			if (!strcmp(name, section_info[j].ds_name))
+				break;
+		if (j == NDEBUG_SECT)
+			continue;
+
+		if (j == DEBUG_FRAME || j == DEBUG_FRAME_HDR) {
+			// Loaded with the kernel image.
+			section_info[j].ds_data = (uint8_t *)sh[i].sh_addr;
+		} else {
+			// Only reserve the space; _dwarf_find_section reads
+			// the section in the first time it is asked for.
+			section_dst[j] = (char *)kvbase + kvoffset;
+			section_diskoff[j] = sh[i].sh_offset;
+			section_pending[j] = 1;
+			section_info[j].ds_data = (uint8_t *)section_dst[j] + OFFSET_CORRECT(sh[i].sh_offset);
+			kvoffset += readseg_span(sh[i].sh_size, sh[i].sh_offset);
+			debug_sect_deferred += sh[i].sh_size;
 		}
+		section_info[j].ds_addr = (uintptr_t)section_info[j].ds_data;
+		section_info[j].ds_size = sh[i].sh_size;
     }
 	
     return ((uintptr_t)kvbase + kvoffset);
 }
 
 // Read 'count' bytes at 'offset' from kernel into physical address 'pa'.
-// Might copy more than asked
+// Might copy more than asked: the whole sectors 'count' bytes touch,
+// readseg_span(count, offset) bytes in all.
 void
 readseg(uint64_t pa, uint64_t count, uint64_t offset, uint64_t* kvoffset)
 {
-	uint64_t end_pa;
-	uint64_t orgoff = offset;
+	uint64_t nsect, n;
 
-	end_pa = pa + count;
+	assert(pa % SECTSIZE == 0);
 
-	assert(pa % SECTSIZE == 0);	
-	// round down to sector boundary
-	pa &= ~(SECTSIZE - 1);
+	nsect = (offset % SECTSIZE + count + SECTSIZE - 1) / SECTSIZE;
 
 	// translate from bytes to sectors, and kernel starts at sector 1
 	offset = (offset / SECTSIZE) + 1;
 
-	// If this is too slow, we could read lots of sectors at a time.
-	// We'd write more to memory than asked, but it doesn't matter --
-	// we load in increasing order.
-	while (pa < end_pa) {
-		readsect((uint8_t*) pa, offset);
-		pa += SECTSIZE;
-		*kvoffset += SECTSIZE;
-		offset++;
-	}
-
-	if(((orgoff % SECTSIZE) + count) > SECTSIZE)
-	{
-		readsect((uint8_t*) pa, offset);
-		*kvoffset += SECTSIZE;
+	// One command reads up to IDE_MAXSECT consecutive sectors.
+	while (nsect > 0) {
+		n = MIN(nsect, IDE_MAXSECT);
+		if (readsects((void *) pa, offset, n) < 0)
+			panic("readseg: disk error reading sector %ld", offset);
+		pa += n * SECTSIZE;
+		*kvoffset += n * SECTSIZE;
+		offset += n;
+		nsect -= n;
 	}
 	assert(*kvoffset % SECTSIZE == 0);
 }
@@ -223,6 +273,203 @@ waitdisk(void)
 		/* do nothing */;
 }
 
+// Wait for the drive to have data for us.  Returns -1 if the command
+// failed instead.
+static int
+waitdrq(void)
+{
+	int r;
+
+	while ((r = inb(0x1F7)) & IDE_BSY)
+		/* do nothing */;
+	if (r & (IDE_DF | IDE_ERR))
+		return -1;
+	return (r & IDE_DRQ) ? 0 : -1;
+}
+
+// How many sectors the drive transfers per interrupt under READ
+// MULTIPLE, once ide_multi_init has set it up; 0 if it can't.
+static int ide_multi = -1;
+
+// Ask the drive how many sectors it can move per READ MULTIPLE data
+// block and switch it to that block size.
+static void
+ide_multi_init(void)
+{
+	uint16_t id[SECTSIZE / 2];
+	int n;
+
+	ide_multi = 0;
+	waitdisk();
+	outb(0x1F6, 0xE0);
+	outb(0x1F7, IDE_CMD_IDENTIFY);
+	if (inb(0x1F7) == 0 || waitdrq() < 0)
+		return;
+	insl(0x1F0, id, SECTSIZE/4);
+
+	// Word 47's low byte is the most sectors per block, 0 if the
+	// drive doesn't do READ MULTIPLE.
+	n = id[47] & 0xFF;
+	if (n <= 1)
+		return;
+	waitdisk();
+	outb(0x1F2, n);
+	outb(0x1F6, 0xE0);
+	outb(0x1F7, IDE_CMD_SETMULT);
+	waitdisk();
+	if (inb(0x1F7) & (IDE_DF | IDE_ERR))
+		return;
+	ide_multi = n;
+}
+
+// A physical region descriptor: one physically contiguous piece of a
+// DMA transfer, which must not cross a 64KB boundary.
+struct IdePrd {
+	uint32_t prd_addr;
+	uint16_t prd_count;	// bytes; 0 means 64KB
+	uint16_t prd_flags;
+};
+#define PRD_EOT		0x8000	// last descriptor in the table
+
+static uint16_t ide_bmbase;	// bus-master ports; 0 if no DMA
+static struct IdePrd *ide_prdt;	// one page of PRDs
+static physaddr_t ide_prdt_pa;
+
+// Look for a PCI IDE controller that can do bus-master DMA and set it
+// up for readsects.  Needs page_alloc; until this runs, and if there is
+// no such controller, the disk is read with PIO.
+void
+ide_dma_init(void)
+{
+	struct pci_func f;
+	struct PageInfo *pp;
+	uint32_t bar;
+
+	if (!pci_find_class(PCI_CLASS_MASS_STORAGE,
+			    PCI_SUBCLASS_MASS_STORAGE_IDE, &f)
+	    || !(PCI_INTERFACE(f.dev_class) & 0x80))
+		return;
+	bar = pci_conf_read(&f, PCI_MAPREG_START + 4 * 4);
+	if (!(bar & 1) || !(bar & ~3))
+		return;
+	if (!(pp = page_alloc(ALLOC_ZERO)))
+		return;
+	pp->pp_ref++;
+
+	pci_conf_write(&f, PCI_COMMAND_STATUS_REG,
+		       pci_conf_read(&f, PCI_COMMAND_STATUS_REG)
+		       | PCI_COMMAND_IO_ENABLE | PCI_COMMAND_MASTER_ENABLE);
+	ide_prdt = page2kva(pp);
+	ide_prdt_pa = page2pa(pp);
+	ide_bmbase = bar & 0xFFFC;
+
+	// readsects_dma polls for completion.
+	outb(IDE_CTL, IDE_CTL_NIEN);
+	cprintf("ide: bus-master DMA at port 0x%x (PCI %02x:%02x.%d)\n",
+		ide_bmbase, f.bus, f.dev, f.func);
+}
+
+// Can readsects_dma transfer 'len' bytes to 'dst'?  The controller
+// reaches only the first 4GB of physical memory, which we find
+// through the KERNBASE mapping.
+static bool
+ide_dma_ok(void *dst, size_t len)
+{
+	uintptr_t va = (uintptr_t) dst;
+
+	return ide_bmbase && va >= KERNBASE
+		&& va + len - KERNBASE <= 0x100000000ULL;
+}
+
+// readsects by bus-master DMA.  Returns 0 on success, -1 on a disk
+// or controller error.
+static int
+readsects_dma(void *dst, uint64_t offset, int nsect)
+{
+	physaddr_t pa = (uintptr_t) dst - KERNBASE;
+	physaddr_t end = pa + nsect * SECTSIZE;
+	size_t n;
+	int i, st, r;
+
+	// At most 128KB, so only a few PRDs.
+	for (i = 0; pa < end; i++, pa += n) {
+		n = MIN(end - pa, 0x10000 - (pa & 0xFFFF));
+		ide_prdt[i].prd_addr = pa;
+		ide_prdt[i].prd_count = n;
+		ide_prdt[i].prd_flags = 0;
+	}
+	ide_prdt[i - 1].prd_flags = PRD_EOT;
+
+	outl(ide_bmbase + BM_PRDT, ide_prdt_pa);
+	outb(ide_bmbase + BM_CMD, BM_CMD_READ);
+	outb(ide_bmbase + BM_STATUS, BM_STATUS_ERR | BM_STATUS_INT);
+
+	waitdisk();
+	outb(0x1F2, nsect);	// count; 0 means 256
+	outb(0x1F3, offset);
+	outb(0x1F4, offset >> 8);
+	outb(0x1F5, offset >> 16);
+	outb(0x1F6, (offset >> 24) | 0xE0);
+	outb(0x1F7, IDE_CMD_READDMA);
+	outb(ide_bmbase + BM_CMD, BM_CMD_READ | BM_CMD_START);
+
+	while (((st = inb(ide_bmbase + BM_STATUS))
+		& (BM_STATUS_ACTIVE | BM_STATUS_ERR | BM_STATUS_INT))
+	       == BM_STATUS_ACTIVE)
+		/* do nothing */;
+	outb(ide_bmbase + BM_CMD, 0);
+	while ((r = inb(0x1F7)) & IDE_BSY)
+		/* do nothing */;
+	outb(ide_bmbase + BM_STATUS, BM_STATUS_ERR | BM_STATUS_INT);
+
+	if ((st & (BM_STATUS_ACTIVE | BM_STATUS_ERR)) || (r & (IDE_DF | IDE_ERR)))
+		return -1;
+	return 0;
+}
+
+// Read 'nsect' (1 to IDE_MAXSECT) consecutive sectors starting at
+// sector 'offset' into 'dst' under one command.  Returns 0 on
+// success, -1 on a disk error.
+int
+readsects(void *dst, uint64_t offset, int nsect)
+{
+	char *p = dst;
+	int blk, n;
+
+	if (ide_dma_ok(dst, nsect * SECTSIZE)) {
+		if (readsects_dma(dst, offset, nsect) == 0)
+			return 0;
+		cprintf("ide: DMA read failed, using PIO\n");
+		ide_bmbase = 0;
+	}
+
+	if (ide_multi < 0)
+		ide_multi_init();
+	blk = ide_multi ? ide_multi : 1;
+
+	// wait for disk to be ready
+	waitdisk();
+
+	outb(0x1F2, nsect);	// count; 0 means 256
+	outb(0x1F3, offset);
+	outb(0x1F4, offset >> 8);
+	outb(0x1F5, offset >> 16);
+	outb(0x1F6, (offset >> 24) | 0xE0);
+	outb(0x1F7, ide_multi ? IDE_CMD_READMULT : IDE_CMD_READ);
+
+	// The drive hands the data over a block of 'blk' sectors at a time.
+	for (; nsect > 0; nsect -= n) {
+		n = MIN(nsect, blk);
+		if (waitdrq() < 0)
+			return -1;
+		insl(0x1F0, p, n * SECTSIZE/4);
+		p += n * SECTSIZE;
+	}
+	return 0;
+}
+
+// Read one sector with a command of its own.  Only diskbench uses it
+// now, to compare against readsects.
 void
 readsect(void *dst, uint64_t offset)
 {
@@ -234,7 +481,7 @@ readsect(void *dst, uint64_t offset)
 	outb(0x1F4, offset >> 8);
 	outb(0x1F5, offset >> 16);
 	outb(0x1F6, (offset >> 24) | 0xE0);
-	outb(0x1F7, 0x20);	// cmd 0x20 - read sectors
+	outb(0x1F7, IDE_CMD_READ);
 
 	// wait for disk to be ready
 	waitdisk();
@@ -243,3 +490,58 @@ readsect(void *dst, uint64_t offset)
 	insl(0x1F0, dst, SECTSIZE/4);
 }
 
+// Time reading every debug section that is read off the disk: one
+// sector per command, then through readseg with PIO, then through
+// readseg with DMA if there is a controller for it.  All read the same
+// bytes into the section's own reserved space, so the sections are
+// loaded afterwards.
+void
+debug_sect_bench(void)
+{
+	uint64_t off, kvoffset, tsc, t1 = 0, t2 = 0, t3 = 0, nsect, bytes = 0;
+	uint16_t bmbase = ide_bmbase;
+	char *dst;
+	int i;
+
+	for (i = 0; i < NDEBUG_SECT; i++) {
+		if (!section_dst[i])
+			continue;
+		nsect = readseg_span(section_info[i].ds_size, section_diskoff[i]) / SECTSIZE;
+		off = section_diskoff[i] / SECTSIZE + 1;
+		dst = section_dst[i];
+		tsc = read_tsc();
+		while (nsect-- > 0) {
+			readsect(dst, off++);
+			dst += SECTSIZE;
+		}
+		t1 += read_tsc() - tsc;
+
+		kvoffset = 0;
+		ide_bmbase = 0;
+		tsc = read_tsc();
+		readseg((uint64_t) section_dst[i], section_info[i].ds_size,
+			section_diskoff[i], &kvoffset);
+		t2 += read_tsc() - tsc;
+		ide_bmbase = bmbase;
+		bytes += kvoffset;
+
+		if (ide_bmbase) {
+			kvoffset = 0;
+			tsc = read_tsc();
+			readseg((uint64_t) section_dst[i], section_info[i].ds_size,
+				section_diskoff[i], &kvoffset);
+			t3 += read_tsc() - tsc;
+		}
+
+		if (section_pending[i]) {
+			section_pending[i] = 0;
+			debug_sect_loaded += section_info[i].ds_size;
+		}
+	}
+	cprintf("%ldKB of debug sections, READ MULTIPLE block %d\n",
+		bytes / 1024, ide_multi);
+	cprintf("  one sector per command: %ld cycles\n", t1);
+	cprintf("  readseg, PIO:           %ld cycles\n", t2);
+	if (ide_bmbase)
+		cprintf("  readseg, DMA:           %ld cycles\n", t3);
+}
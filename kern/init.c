@@ -10,6 +10,7 @@
 #include <kern/kdebug.h>
 #include <kern/dwarf_api.h>
 #include <kern/pmap.h>
+#include <kern/kmalloc.h>
 #include <kern/kclock.h>
 
 uint64_t end_debug;
@@ -38,6 +39,10 @@ i386_init(void)
 
 	// Lab 2 memory management initialization functions
 	x64_vm_init();
+	kmalloc_init();
+
+	// From here on the debug sections can be read in by DMA.
+	ide_dma_init();
 
 	// Drop into the kernel monitor.
 	while (1)
@@ -72,6 +77,7 @@ _panic(const char *file, int line, const char *fmt,...)
 	vcprintf(fmt, ap);
 	cprintf("\n");
 	va_end(ap);
+	cons_flush();
 
 dead:
 	/* break into the kernel monitor */
@@ -4,6 +4,7 @@
 #include <inc/assert.h>
 
 #include <kern/kdebug.h>
+#include <kern/kmalloc.h>
 #include <kern/dwarf.h>
 #include <kern/dwarf_api.h>
 #include <kern/dwarf_elf.h>
@@ -73,11 +74,29 @@ static const char *const dwarf_regnames_i386[] =
 #endif
 
 
+// Fill in [*lo, *hi) from the DW_AT_low_pc and DW_AT_high_pc of 'die'.
+// Returns 0 if it has no such range.  Since DWARF 4, high_pc may be an
+// offset from low_pc rather than an address.
+static int
+die_pc_range(Dwarf_Die *die, uint64_t *lo, uint64_t *hi)
+{
+	Dwarf_Attribute *low, *high;
+
+	low = _dwarf_attr_find(die, DW_AT_low_pc);
+	high = _dwarf_attr_find(die, DW_AT_high_pc);
+	if (!low || !high)
+		return 0;
+	*lo = low->u[0].u64;
+	*hi = high->u[0].u64;
+	if (high->at_form != DW_FORM_addr)
+		*hi += *lo;
+	return *lo < *hi;
+}
+
 int list_func_die(struct Ripdebuginfo *info, Dwarf_Die *die, uint64_t addr)
 {
 	_Dwarf_Line ln;
-	Dwarf_Attribute *low;
-	Dwarf_Attribute *high;
+	uint64_t lo, hi;
 	Dwarf_CU *cu = die->cu_header;
 	Dwarf_Die *cudie = die->cu_die; 
 	Dwarf_Die ret, sib=*die; 
@@ -90,17 +109,14 @@ int list_func_die(struct Ripdebuginfo *info, Dwarf_Die *die, uint64_t addr)
 
 	memset(&ln, 0, sizeof(_Dwarf_Line));
 
-	low  = _dwarf_attr_find(die, DW_AT_low_pc);
-	high = _dwarf_attr_find(die, DW_AT_high_pc);
-
-	if((low && (low->u[0].u64 < addr)) && (high && (high->u[0].u64 > addr)))
+	if(die_pc_range(die, &lo, &hi) && lo <= addr && addr < hi)
 	{
 		info->rip_file = die->cu_die->die_name;
 
 		info->rip_fn_name = die->die_name;
         info->rip_fn_namelen = strlen(die->die_name);
 
-		info->rip_fn_addr = (uintptr_t)low->u[0].u64;
+		info->rip_fn_addr = (uintptr_t)lo;
 
 		assert(die->cu_die);	
 		dwarf_srclines(die->cu_die, &ln, addr, NULL); 
@@ -169,33 +185,272 @@ last:
 	return 0;
 }
 
+// --------------------------------------------------------------
+// Function address index.
+// Rather than parse every compilation unit in .debug_info for each
+// address, the first lookup records the pc range of every top-level
+// function, sorted by start address.  Later lookups binary search the
+// table and parse only the DIEs of the function they land in.  When
+// .debug_aranges is present, only the CUs it lists as holding code are
+// walked to build the table.
+// --------------------------------------------------------------
+
+struct FuncRange {
+	uint64_t fr_lo;		// first address of the function
+	uint64_t fr_hi;		// one past its last address
+	uint64_t fr_cu;		// offset of its CU in .debug_info
+	uint64_t fr_die;	// offset of its DIE in .debug_info
+};
+
+static struct FuncRange *func_ranges;
+static int nfunc_ranges;
+static int func_ranges_cap;
+static bool func_ranges_built;
+
+static int
+func_range_add(uint64_t lo, uint64_t hi, uint64_t cu, uint64_t die)
+{
+	struct FuncRange *fr;
+	int i, cap;
+
+	if (nfunc_ranges == func_ranges_cap) {
+		cap = func_ranges_cap ? 2 * func_ranges_cap : 256;
+		if (!(fr = kmalloc(cap * sizeof(*fr), 0)))
+			return -1;
+		memmove(fr, func_ranges, nfunc_ranges * sizeof(*fr));
+		kfree(func_ranges);
+		func_ranges = fr;
+		func_ranges_cap = cap;
+	}
+
+	// Insertion sort.  Functions mostly come in address order, so this
+	// rarely moves anything.
+	for (i = nfunc_ranges; i > 0 && func_ranges[i - 1].fr_lo > lo; i--)
+		func_ranges[i] = func_ranges[i - 1];
+	func_ranges[i].fr_lo = lo;
+	func_ranges[i].fr_hi = hi;
+	func_ranges[i].fr_cu = cu;
+	func_ranges[i].fr_die = die;
+	nfunc_ranges++;
+	return 0;
+}
+
+// Record the functions among the top-level DIEs of the CU at 'cu_off'.
+// The DIEs are big, so the caller provides them.
+static int
+func_ranges_add_cu(uint64_t cu_off, Dwarf_CU *cu, Dwarf_Die *cudie,
+		   Dwarf_Die *die, Dwarf_Die *next)
+{
+	Dwarf_Die *tmp;
+	uint64_t lo, hi;
+
+	dbg->curr_off_dbginfo = cu_off;
+	if (_get_next_cu(dbg, cu) != 0)
+		return 0;
+	if (dwarf_siblingof(dbg, NULL, cudie, cu) != 0)
+		return 0;
+	if (dwarf_child(dbg, cu, cudie, die) != DW_DLV_OK)
+		return 0;
+	while (1) {
+		if (die->die_tag == DW_TAG_subprogram && die_pc_range(die, &lo, &hi)
+		    && func_range_add(lo, hi, cu_off, die->die_offset) < 0)
+			return -1;
+		if (dwarf_siblingof(dbg, die, next, cu) != DW_DLV_OK)
+			break;
+		tmp = die;
+		die = next;
+		next = tmp;
+	}
+	return 0;
+}
+
+// Walk the CUs that .debug_aranges says hold code.  Returns 1 if
+// there is no usable .debug_aranges.
+static int
+func_ranges_from_aranges(Dwarf_CU *cu, Dwarf_Die *cudie, Dwarf_Die *die,
+			 Dwarf_Die *next)
+{
+	Dwarf_Section *ds = _dwarf_find_section(".debug_aranges");
+	uint64_t off, start, end, length, cu_off, addr, len;
+	int dwarf_size, addr_size, has_code;
+
+	if (!ds || !ds->ds_data || !ds->ds_size)
+		return 1;
+
+	for (off = 0; off < ds->ds_size; off = end) {
+		// Set header: length, version, CU offset, address size and
+		// segment size, then (address, length) pairs aligned to
+		// twice the address size from the start of the set.
+		start = off;
+		dwarf_size = 4;
+		length = dbg->read(ds->ds_data, &off, 4);
+		if (length == 0xffffffff) {
+			dwarf_size = 8;
+			length = dbg->read(ds->ds_data, &off, 8);
+		}
+		end = off + length;
+		if (end > ds->ds_size || dbg->read(ds->ds_data, &off, 2) != 2)
+			return 1;
+		cu_off = dbg->read(ds->ds_data, &off, dwarf_size);
+		addr_size = dbg->read(ds->ds_data, &off, 1);
+		if ((addr_size != 4 && addr_size != 8)
+		    || dbg->read(ds->ds_data, &off, 1) != 0)
+			return 1;
+		off = start + ROUNDUP(off - start, 2 * addr_size);
+
+		has_code = 0;
+		while (off + 2 * addr_size <= end) {
+			addr = dbg->read(ds->ds_data, &off, addr_size);
+			len = dbg->read(ds->ds_data, &off, addr_size);
+			if (addr == 0 && len == 0)
+				break;
+			if (len)
+				has_code = 1;
+		}
+		if (has_code && func_ranges_add_cu(cu_off, cu, cudie, die, next) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+static int
+func_ranges_build(Dwarf_CU *cu, Dwarf_Die *cudie, Dwarf_Die *die,
+		  Dwarf_Die *next)
+{
+	int r;
+
+	nfunc_ranges = 0;
+	if ((r = func_ranges_from_aranges(cu, cudie, die, next)) > 0) {
+		nfunc_ranges = 0;
+		dbg->curr_off_dbginfo = 0;
+		while (dbg->curr_off_dbginfo < dbg->dbg_info_size)
+			if ((r = func_ranges_add_cu(dbg->curr_off_dbginfo, cu, cudie, die, next)) < 0)
+				break;
+	}
+	if (r < 0) {
+		// Out of memory, maybe because kmalloc is not up yet.
+		// Try again on the next lookup.
+		kfree(func_ranges);
+		func_ranges = NULL;
+		nfunc_ranges = func_ranges_cap = 0;
+		return -1;
+	}
+	func_ranges_built = 1;
+	return 0;
+}
+
+// Return the function whose code contains 'addr', or NULL.
+static struct FuncRange *
+func_range_find(uint64_t addr)
+{
+	int lo = 0, hi = nfunc_ranges, mid;
+
+	// find the first function starting above addr
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (func_ranges[mid].fr_lo <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == 0 || addr >= func_ranges[lo - 1].fr_hi)
+		return NULL;
+	return &func_ranges[lo - 1];
+}
+
+// The table of kernel text symbols the build links into the kernel
+// (see kern/mksymtab.pl).  It needs no debug sections.
+extern const uint32_t ksym_count;
+extern const uintptr_t ksym_addrs[];
+extern const uint32_t ksym_names[];
+extern const char ksym_strs[];
+extern char etext[];
+
+// Return the name of the kernel text symbol containing 'addr' and set
+// *start to its address, or return NULL.
+const char *
+ksym_lookup(uintptr_t addr, uintptr_t *start)
+{
+	uint32_t lo = 0, hi = ksym_count, mid;
+
+	if (addr >= (uintptr_t) etext)
+		return NULL;
+	// find the first symbol above addr
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (ksym_addrs[mid] <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == 0)
+		return NULL;
+	*start = ksym_addrs[lo - 1];
+	return ksym_strs + ksym_names[lo - 1];
+}
+
+static int debuginfo_rip_dwarf(uintptr_t addr, struct Ripdebuginfo *info,
+			       void *elf);
+
+// debuginfo_rip_fn(addr, info)
+//
+//	Like debuginfo_rip, but fill in only the function's name and start
+//	address, from the kernel symbol table.  Never reads DWARF or the
+//	disk, so it is cheap enough for callers that want nothing more,
+//	like a profiler, and works before the debug sections are loaded.
+//	Returns 0 if a symbol covers 'addr', and negative if not.
+//
+int
+debuginfo_rip_fn(uintptr_t addr, struct Ripdebuginfo *info)
+{
+	const char *sym;
+	uintptr_t sym_addr;
+
+	info->rip_file = "<unknown>";
+	info->rip_line = 0;
+	info->rip_fn_name = "<unknown>";
+	info->rip_fn_namelen = 9;
+	info->rip_fn_addr = addr;
+	info->rip_fn_narg = 0;
+
+	if (!(sym = ksym_lookup(addr, &sym_addr)))
+		return -1;
+	info->rip_fn_name = sym;
+	info->rip_fn_namelen = strlen(sym);
+	info->rip_fn_addr = sym_addr;
+	return 0;
+}
+
+// Set while debuginfo_rip or unwind_row is inside the DWARF readers,
+// which share 'dbg' and the frame reader's state.  A lookup that
+// interrupts one of them (say, from a sampling interrupt) gets only
+// what needs no DWARF: the symbol name, or a cached unwind row.
+static bool dwarf_busy;
+
 // debuginfo_rip(addr, info)
 //
 //	Fill in the 'info' structure with information about the specified
 //	instruction address, 'addr'.  Returns 0 if information was found, and
 //	negative if not.  But even if it returns negative it has stored some
-//	information into '*info'.
+//	information into '*info'.  File and line come from DWARF, which may
+//	mean reading the debug sections off the disk; callers that need
+//	only the function's name should use debuginfo_rip_fn.
 //
 int
 debuginfo_rip(uintptr_t addr, struct Ripdebuginfo *info)
 {
     static struct Env* lastenv = NULL;
     void* elf;    
-    Dwarf_Section *sect;
-    Dwarf_CU cu;
-    Dwarf_Die die, cudie, die2;
     Dwarf_Regtable *rt = NULL;
+    int sym, r;
     //Set up initial pc
     uint64_t pc  = (uintptr_t)addr;
 
     
-    // Initialize *info
-    info->rip_file = "<unknown>";
-    info->rip_line = 0;
-    info->rip_fn_name = "<unknown>";
-    info->rip_fn_namelen = 9;
-    info->rip_fn_addr = addr;
-    info->rip_fn_narg = 0;
+    // Initialize *info.  The symbol table names the function even when
+    // the debug sections are not loaded or do not describe it (assembly
+    // code); only file and line need DWARF.
+    sym = debuginfo_rip_fn(addr, info) == 0;
     
     // Find the relevant set of stabs
     if (addr >= ULIM) {
@@ -204,15 +459,53 @@ debuginfo_rip(uintptr_t addr, struct Ripdebuginfo *info)
 	    // Can't search for user-level addresses yet!
 	    panic("User address");
     }
-    
-    
+
+    // A lookup that interrupted another one must not touch 'dbg'.
+    if (dwarf_busy)
+	    return sym ? 0 : -1;
+    dwarf_busy = 1;
+    r = debuginfo_rip_dwarf(addr, info, elf);
+    dwarf_busy = 0;
+    return r == 0 || sym ? 0 : -1;
+}
+
+// The DWARF half of debuginfo_rip: file, line, and the function's
+// arguments.  Returns 0 if the address was found.
+static int
+debuginfo_rip_dwarf(uintptr_t addr, struct Ripdebuginfo *info, void *elf)
+{
+    Dwarf_Section *sect;
+    Dwarf_CU cu;
+    Dwarf_Die die, cudie, die2;
+    struct FuncRange *fr;
+
     _dwarf_init(dbg, elf);
 
     sect = _dwarf_find_section(".debug_info");	
     dbg->dbg_info_offset_elf = (uint64_t)sect->ds_data; 
     dbg->dbg_info_size = sect->ds_size;
     
-    assert(dbg->dbg_info_size);
+    if (!dbg->dbg_info_size)
+	    return -1;
+
+    if (func_ranges_built || func_ranges_build(&cu, &cudie, &die, &die2) == 0)
+    {
+	    if (!(fr = func_range_find(addr)))
+		    return -1;
+	    dbg->curr_off_dbginfo = fr->fr_cu;
+	    if (_get_next_cu(dbg, &cu) != 0
+		|| dwarf_siblingof(dbg, NULL, &cudie, &cu) != 0
+		|| dwarf_offdie(dbg, fr->fr_die, &die, cu) != 0)
+		    return -1;
+	    cudie.cu_header = &cu;
+	    cudie.cu_die = NULL;
+	    die.cu_header = &cu;
+	    die.cu_die = &cudie;
+	    return list_func_die(info, &die, addr) ? 0 : -1;
+    }
+
+    // No index: scan every CU.
+    dbg->curr_off_dbginfo = 0;
     while(_get_next_cu(dbg, &cu) == 0)
     {
 	    if(dwarf_siblingof(dbg, NULL, &cudie, &cu) == DW_DLE_NO_ENTRY)
@@ -246,3 +539,157 @@ find_done:
     return 0;
 
 }
+
+
+/***** Stack unwinding from .eh_frame *****/
+
+// DWARF register numbers on x86-64
+#define DW_X86_64_RBP	6
+#define DW_X86_64_RSP	7
+#define DW_X86_64_RA	16
+
+// What one .eh_frame rule row says about the code in [ur_lo, ur_hi):
+// the CFA is register ur_cfa_reg plus ur_cfa_off, the return address is
+// saved at CFA + ur_ra_off, and the caller's rbp is saved at CFA +
+// ur_rbp_off if ur_rbp_saved is set and is unchanged otherwise.
+// Rows are memoized in a direct-mapped cache indexed by pc, so
+// unwinding through code seen before touches no DWARF at all.
+struct UnwindRow {
+	uintptr_t ur_lo;
+	uintptr_t ur_hi;
+	int32_t ur_cfa_off;
+	int32_t ur_ra_off;
+	int32_t ur_rbp_off;
+	uint8_t ur_cfa_reg;
+	bool ur_rbp_saved;
+};
+
+#define UNWIND_CACHE_SIZE	256	// power of two
+
+static struct UnwindRow unwind_cache[UNWIND_CACHE_SIZE];
+
+// Compute the rule row covering pc into *ur.  Returns false if there is
+// none or it uses rules the unwinder does not follow.
+static bool
+unwind_row_compute(uintptr_t pc, struct UnwindRow *ur)
+{
+	Dwarf_Regtable_Entry3 rules[DW_X86_64_RA + 1];
+	struct _Dwarf_Fde fde;
+	struct _Dwarf_Cie cie;
+	Dwarf_Regtable3 rt;
+	Dwarf_Regtable_Entry3 *cfa, *ra, *rbp;
+	Dwarf_Addr lo, hi, row_lo, row_hi;
+
+	// Set up the frame reader without disturbing a lookup in progress.
+	if (!dbg->read)
+		_dwarf_init(dbg, (void *) (0x10000 + KERNBASE));
+	if (!dbg->dbg_internal_reg_table
+	    && dwarf_init_eh_section(dbg, NULL) != DW_DLV_OK)
+		return 0;
+
+	if (dwarf_get_fde_at_pc(pc, &lo, &hi, &fde, &cie, NULL) != DW_DLV_OK)
+		return 0;
+	rt.rt3_reg_table_size = DW_X86_64_RA + 1;
+	rt.rt3_rules = rules;
+	if (dwarf_get_fde_info_for_all_regs3(&fde, pc, &rt, &row_lo, &row_hi,
+					     NULL) != DW_DLV_OK)
+		return 0;
+
+	// Only what gcc emits for kernel code: the CFA is a register plus
+	// an offset, and registers are saved at offsets from the CFA.
+	cfa = &rt.rt3_cfa_rule;
+	ra = &rules[DW_X86_64_RA];
+	rbp = &rules[DW_X86_64_RBP];
+	if (!cfa->dw_offset_relevant || cfa->dw_value_type != DW_EXPR_OFFSET
+	    || (cfa->dw_regnum != DW_X86_64_RSP
+		&& cfa->dw_regnum != DW_X86_64_RBP))
+		return 0;
+	if (!ra->dw_offset_relevant || ra->dw_value_type != DW_EXPR_OFFSET
+	    || ra->dw_regnum != dbg->dbg_frame_cfa_value)
+		return 0;
+
+	ur->ur_lo = row_lo;
+	ur->ur_hi = row_hi;
+	ur->ur_cfa_reg = cfa->dw_regnum;
+	ur->ur_cfa_off = cfa->dw_offset_or_block_len;
+	ur->ur_ra_off = ra->dw_offset_or_block_len;
+	ur->ur_rbp_saved = rbp->dw_offset_relevant
+		&& rbp->dw_value_type == DW_EXPR_OFFSET
+		&& rbp->dw_regnum == dbg->dbg_frame_cfa_value;
+	ur->ur_rbp_off = ur->ur_rbp_saved ? rbp->dw_offset_or_block_len : 0;
+	return 1;
+}
+
+// Return the rule row covering pc, or NULL if there is none or it uses
+// rules the unwinder does not follow.  Safe to call from an interrupt:
+// a nested call is served from the cache only.
+static struct UnwindRow *
+unwind_row(uintptr_t pc)
+{
+	struct UnwindRow *ur, row;
+	bool ok;
+
+	ur = &unwind_cache[(pc ^ (pc >> 8)) & (UNWIND_CACHE_SIZE - 1)];
+	if (ur->ur_lo <= pc && pc < ur->ur_hi)
+		return ur;
+
+	if (dwarf_busy)
+		return NULL;
+	dwarf_busy = 1;
+	ok = unwind_row_compute(pc, &row);
+	dwarf_busy = 0;
+	if (!ok)
+		return NULL;
+
+	// Empty the slot while refilling it, so an interrupt in between
+	// cannot match the new range against the old rules.
+	ur->ur_hi = 0;
+	__asm __volatile("" : : : "memory");
+	ur->ur_cfa_off = row.ur_cfa_off;
+	ur->ur_ra_off = row.ur_ra_off;
+	ur->ur_rbp_off = row.ur_rbp_off;
+	ur->ur_cfa_reg = row.ur_cfa_reg;
+	ur->ur_rbp_saved = row.ur_rbp_saved;
+	ur->ur_lo = row.ur_lo;
+	__asm __volatile("" : : : "memory");
+	ur->ur_hi = row.ur_hi;
+	return ur;
+}
+
+// Walk up the stack from the frame in *regs, storing the rip of each
+// frame in rips, starting with regs->uw_rip, until max frames are
+// stored or a frame has no usable rule row.  Needs no frame pointers.
+// Leaves *regs describing the last frame reached and returns the
+// number of rips stored.
+int
+unwind_stack(struct Unwindregs *regs, uintptr_t *rips, int max)
+{
+	struct UnwindRow *ur;
+	uintptr_t pc, cfa;
+	int n;
+
+	for (n = 0; n < max; ) {
+		rips[n++] = regs->uw_rip;
+
+		// A return address can be just past the end of the calling
+		// function, so look up the call instruction instead.
+		pc = n == 1 ? regs->uw_rip : regs->uw_rip - 1;
+		if (!(ur = unwind_row(pc)))
+			break;
+
+		cfa = (ur->ur_cfa_reg == DW_X86_64_RSP ? regs->uw_rsp
+		       : regs->uw_rbp) + ur->ur_cfa_off;
+		// The CFA is above this frame, on the same stack.
+		if (cfa <= regs->uw_rsp || cfa - regs->uw_rsp > KSTKSIZE
+		    || cfa % sizeof(uintptr_t))
+			break;
+
+		if (ur->ur_rbp_saved)
+			regs->uw_rbp = *(uintptr_t *) (cfa + ur->ur_rbp_off);
+		regs->uw_rip = *(uintptr_t *) (cfa + ur->ur_ra_off);
+		regs->uw_rsp = cfa;
+		if (!regs->uw_rip)
+			break;
+	}
+	return n;
+}
@@ -19,5 +19,16 @@ struct Ripdebuginfo {
 };
 
 int debuginfo_rip(uintptr_t rip, struct Ripdebuginfo *info);
+int debuginfo_rip_fn(uintptr_t rip, struct Ripdebuginfo *info);
+const char *ksym_lookup(uintptr_t addr, uintptr_t *start);
+
+// The registers the unwinder needs to step from one frame to its caller.
+struct Unwindregs {
+	uintptr_t uw_rip;
+	uintptr_t uw_rsp;
+	uintptr_t uw_rbp;
+};
+
+int unwind_stack(struct Unwindregs *regs, uintptr_t *rips, int max);
 
 #endif
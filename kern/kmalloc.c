@@ -0,0 +1,452 @@
+/* See COPYRIGHT for copyright information. */
+
+#include <inc/assert.h>
+#include <inc/queue.h>
+#include <inc/stdio.h>
+#include <inc/string.h>
+
+#include <kern/cpu.h>
+#include <kern/kmalloc.h>
+#include <kern/pmap.h>
+
+// --------------------------------------------------------------
+// Slabs.
+// A slab is one buddy block of 2^kc_order pages cut into objects of a
+// single size.  Its struct Slab sits at the start of the block and every
+// page of the block points back at it through pp_slab, so kfree finds
+// the slab of any object in O(1).  Free objects are chained through
+// their first word.  Each cache sorts its slabs by how full they are,
+// and keeps at most one empty slab; further empty ones go back to the
+// page allocator.
+// --------------------------------------------------------------
+
+struct KmemCache;
+
+struct Slab {
+	LIST_ENTRY(Slab) sl_link;	// on kc_partial, kc_full or kc_empty
+	struct KmemCache *sl_cache;	// cache the slab belongs to
+	void *sl_free;			// first free object, or NULL
+	int sl_inuse;			// objects not on sl_free
+};
+LIST_HEAD(Slab_list, Slab);
+
+// Objects start this far into a slab, past its struct Slab, so they
+// are at least 16-byte aligned.
+#define SLAB_HDR	64
+
+// Slabs are made big enough to hold at least this many objects, which
+// keeps the space lost to the header and the tail under about 1/8.
+#define SLAB_MIN_OBJS	8
+
+// Per-CPU stack of free objects.  As with the page caches, the common
+// kmalloc and kfree paths only touch the current CPU's magazine.
+struct KmemMagazine {
+	void *km_objs[KMEM_MAG_SIZE];	// top is the hottest
+	int km_count;
+	uint64_t km_hits;		// kmallocs served without a refill
+	uint64_t km_refills;		// batches taken from the slabs
+	uint64_t km_flushes;		// batches given back to the slabs
+};
+
+struct KmemCache {
+	size_t kc_size;			// object size
+	int kc_order;			// slabs are 2^kc_order pages
+	int kc_perslab;			// objects per slab
+	struct Slab_list kc_partial;	// slabs with some objects free
+	struct Slab_list kc_full;	// slabs with no objects free
+	struct Slab_list kc_empty;	// slabs with every object free
+	int kc_nslabs;
+	int kc_nempty;			// slabs on kc_empty
+	uint64_t kc_allocs;
+	uint64_t kc_frees;
+	struct KmemMagazine kc_mags[NCPU];
+};
+
+static struct KmemCache kmem_caches[KMALLOC_NCLASSES];
+
+static uint64_t kmem_large_allocs;	// requests above KMALLOC_MAX
+static size_t kmem_large_pages;		// pages they hold right now
+static bool kmalloc_ready;		// kmalloc_init has set up the classes
+
+static void check_kmalloc(void);
+
+//
+// Set up the size classes.  Needs the page allocator.
+//
+void
+kmalloc_init(void)
+{
+	struct KmemCache *kc;
+	int i;
+
+	static_assert(sizeof(struct Slab) <= SLAB_HDR);
+	static_assert((KMALLOC_MIN << (KMALLOC_NCLASSES - 1)) == KMALLOC_MAX);
+
+	for (i = 0; i < KMALLOC_NCLASSES; i++) {
+		kc = &kmem_caches[i];
+		kc->kc_size = KMALLOC_MIN << i;
+		kc->kc_order = 0;
+		while ((PGSIZE << kc->kc_order) - SLAB_HDR < SLAB_MIN_OBJS * kc->kc_size)
+			kc->kc_order++;
+		kc->kc_perslab = ((PGSIZE << kc->kc_order) - SLAB_HDR) / kc->kc_size;
+	}
+	kmalloc_ready = 1;
+
+	check_kmalloc();
+}
+
+// Index of the smallest size class holding 'size' bytes.
+static int
+kmem_class(size_t size)
+{
+	if (size <= KMALLOC_MIN)
+		return 0;
+	return 64 - __builtin_clzl(size - 1) - 4;
+}
+
+static struct Slab *
+slab_of(void *obj)
+{
+	return pa2page(PADDR(obj))->pp_slab;
+}
+
+static struct Slab *
+slab_create(struct KmemCache *kc)
+{
+	struct PageInfo *pp;
+	struct Slab *sl;
+	char *obj;
+	int i;
+
+	if (!(pp = page_alloc_order(kc->kc_order, 0)))
+		return NULL;
+	sl = page2kva(pp);
+	for (i = 0; i < (1 << kc->kc_order); i++)
+		pp[i].pp_slab = sl;
+
+	sl->sl_cache = kc;
+	sl->sl_inuse = 0;
+	sl->sl_free = NULL;
+	obj = (char *) sl + SLAB_HDR + kc->kc_perslab * kc->kc_size;
+	for (i = 0; i < kc->kc_perslab; i++) {
+		obj -= kc->kc_size;
+		*(void **) obj = sl->sl_free;
+		sl->sl_free = obj;
+	}
+	kc->kc_nslabs++;
+	return sl;
+}
+
+static void
+slab_destroy(struct Slab *sl)
+{
+	struct KmemCache *kc = sl->sl_cache;
+	struct PageInfo *pp = pa2page(PADDR(sl));
+	int i;
+
+	assert(sl->sl_inuse == 0);
+	for (i = 0; i < (1 << kc->kc_order); i++)
+		pp[i].pp_slab = NULL;
+	page_free_order(pp, kc->kc_order);
+	kc->kc_nslabs--;
+}
+
+static void *
+slab_alloc(struct KmemCache *kc)
+{
+	struct Slab *sl;
+	void *obj;
+
+	if (!(sl = LIST_FIRST(&kc->kc_partial))) {
+		if ((sl = LIST_FIRST(&kc->kc_empty))) {
+			LIST_REMOVE(sl, sl_link);
+			kc->kc_nempty--;
+		} else if (!(sl = slab_create(kc)))
+			return NULL;
+		LIST_INSERT_HEAD(&kc->kc_partial, sl, sl_link);
+	}
+
+	obj = sl->sl_free;
+	sl->sl_free = *(void **) obj;
+	if (++sl->sl_inuse == kc->kc_perslab) {
+		LIST_REMOVE(sl, sl_link);
+		LIST_INSERT_HEAD(&kc->kc_full, sl, sl_link);
+	}
+	return obj;
+}
+
+static void
+slab_free(void *obj)
+{
+	struct Slab *sl = slab_of(obj);
+	struct KmemCache *kc = sl->sl_cache;
+
+	*(void **) obj = sl->sl_free;
+	sl->sl_free = obj;
+	if (sl->sl_inuse-- == kc->kc_perslab) {
+		LIST_REMOVE(sl, sl_link);
+		LIST_INSERT_HEAD(&kc->kc_partial, sl, sl_link);
+	}
+	if (sl->sl_inuse == 0) {
+		LIST_REMOVE(sl, sl_link);
+		if (kc->kc_nempty)
+			slab_destroy(sl);
+		else {
+			LIST_INSERT_HEAD(&kc->kc_empty, sl, sl_link);
+			kc->kc_nempty++;
+		}
+	}
+}
+
+static void
+kmem_mag_refill(struct KmemCache *kc, struct KmemMagazine *m)
+{
+	void *obj;
+	int i;
+
+	for (i = 0; i < KMEM_MAG_BATCH; i++) {
+		if (!(obj = slab_alloc(kc)))
+			break;
+		m->km_objs[m->km_count++] = obj;
+	}
+	m->km_refills++;
+}
+
+// Give the n coldest objects (the bottom of the stack) back to their
+// slabs.
+static void
+kmem_mag_flush(struct KmemMagazine *m, int n)
+{
+	int i;
+
+	n = MIN(n, m->km_count);
+	for (i = 0; i < n; i++)
+		slab_free(m->km_objs[i]);
+	memmove(m->km_objs, m->km_objs + n,
+		(m->km_count - n) * sizeof(m->km_objs[0]));
+	m->km_count -= n;
+	m->km_flushes++;
+}
+
+static void *
+kmalloc_large(size_t size, int alloc_flags)
+{
+	struct PageInfo *pp;
+	int order = 0;
+
+	while ((size_t) PGSIZE << order < size)
+		order++;
+	if (!(pp = page_alloc_order(order, alloc_flags)))
+		return NULL;
+	kmem_large_allocs++;
+	kmem_large_pages += 1 << order;
+	return page2kva(pp);
+}
+
+//
+// Allocate 'size' bytes of kernel memory.  If (alloc_flags &
+// ALLOC_ZERO), the memory is zeroed.  Returns NULL if size is 0,
+// memory is short, or kmalloc_init has not run yet (a panic early in
+// boot can still reach the debugger, which allocates).
+//
+// Up to KMALLOC_MAX bytes come out of the size class caches, aligned to
+// 16 bytes.  Anything larger is a block of whole pages.
+//
+void *
+kmalloc(size_t size, int alloc_flags)
+{
+	struct KmemCache *kc;
+	struct KmemMagazine *m;
+	void *obj;
+
+	if (size == 0 || !kmalloc_ready)
+		return NULL;
+	if (size > KMALLOC_MAX)
+		return kmalloc_large(size, alloc_flags);
+
+	kc = &kmem_caches[kmem_class(size)];
+	m = &kc->kc_mags[cpunum()];
+	if (m->km_count)
+		m->km_hits++;
+	else {
+		kmem_mag_refill(kc, m);
+		if (!m->km_count)
+			return NULL;
+	}
+	obj = m->km_objs[--m->km_count];
+	kc->kc_allocs++;
+
+	if (alloc_flags & ALLOC_ZERO)
+		memset(obj, 0, kc->kc_size);
+	return obj;
+}
+
+//
+// Free memory returned by kmalloc.  kfree(NULL) does nothing.
+//
+void
+kfree(void *va)
+{
+	struct PageInfo *pp;
+	struct KmemCache *kc;
+	struct KmemMagazine *m;
+
+	if (!va)
+		return;
+
+	pp = pa2page(PADDR(va));
+	if (!pp->pp_slab) {
+		if (PGOFF(va))
+			panic("kfree: %p was not returned by kmalloc", va);
+		kmem_large_pages -= 1 << pp->pp_order;
+		page_free_order(pp, pp->pp_order);
+		return;
+	}
+
+	kc = pp->pp_slab->sl_cache;
+	m = &kc->kc_mags[cpunum()];
+	if (m->km_count == KMEM_MAG_SIZE)
+		kmem_mag_flush(m, KMEM_MAG_BATCH);
+	m->km_objs[m->km_count++] = va;
+	kc->kc_frees++;
+}
+
+//
+// Empty every CPU's magazines back into the slabs and give all empty
+// slabs back to the page allocator.  The other CPUs must not be
+// allocating while this runs.
+//
+void
+kmem_drain_all(void)
+{
+	struct KmemCache *kc;
+	struct Slab *sl;
+	int i, j;
+
+	for (i = 0; i < KMALLOC_NCLASSES; i++) {
+		kc = &kmem_caches[i];
+		for (j = 0; j < NCPU; j++)
+			if (kc->kc_mags[j].km_count)
+				kmem_mag_flush(&kc->kc_mags[j], kc->kc_mags[j].km_count);
+		while ((sl = LIST_FIRST(&kc->kc_empty))) {
+			LIST_REMOVE(sl, sl_link);
+			kc->kc_nempty--;
+			slab_destroy(sl);
+		}
+	}
+}
+
+void
+kmem_print_stats(void)
+{
+	struct KmemCache *kc;
+	struct KmemMagazine *m;
+	struct Slab *sl;
+	size_t inuse, cached;
+	int i, j;
+
+	cprintf(" size  slab  objs/slab  slabs   in use   cached    allocs     frees\n");
+	for (i = 0; i < KMALLOC_NCLASSES; i++) {
+		kc = &kmem_caches[i];
+		inuse = cached = 0;
+		LIST_FOREACH(sl, &kc->kc_partial, sl_link)
+			inuse += sl->sl_inuse;
+		LIST_FOREACH(sl, &kc->kc_full, sl_link)
+			inuse += sl->sl_inuse;
+		for (j = 0; j < NCPU; j++)
+			cached += kc->kc_mags[j].km_count;
+		cprintf("%5d %4dK  %9d  %5d  %7d  %7d  %8d  %8d\n",
+			kc->kc_size, 4 << kc->kc_order, kc->kc_perslab,
+			kc->kc_nslabs, inuse - cached, cached,
+			kc->kc_allocs, kc->kc_frees);
+	}
+	for (i = 0; i < NCPU; i++) {
+		uint64_t hits = 0, refills = 0, flushes = 0;
+
+		for (j = 0; j < KMALLOC_NCLASSES; j++) {
+			m = &kmem_caches[j].kc_mags[i];
+			hits += m->km_hits;
+			refills += m->km_refills;
+			flushes += m->km_flushes;
+		}
+		if (!hits && !refills)
+			continue;
+		cprintf("cpu %d magazines: %d hits, %d refills, %d flushes\n",
+			i, hits, refills, flushes);
+	}
+	cprintf("%d large allocations, %d pages held\n",
+		kmem_large_allocs, kmem_large_pages);
+}
+
+
+// --------------------------------------------------------------
+// Checking functions.
+// --------------------------------------------------------------
+
+static void
+check_kmalloc(void)
+{
+	struct KmemCache *kc;
+	struct Slab *sl;
+	char **objs, *p, *q;
+	int i, j, n, c;
+
+	// size classes
+	assert(kmem_class(1) == 0 && kmem_class(KMALLOC_MIN) == 0);
+	assert(kmem_class(KMALLOC_MIN + 1) == 1);
+	assert(kmem_class(KMALLOC_MAX) == KMALLOC_NCLASSES - 1);
+	assert(kmalloc(0, 0) == NULL);
+	kfree(NULL);
+
+	for (c = 0; c < KMALLOC_NCLASSES; c++) {
+		kc = &kmem_caches[c];
+		assert(kc->kc_perslab >= SLAB_MIN_OBJS);
+
+		// enough objects to fill several slabs and spill magazines
+		n = 3 * kc->kc_perslab + KMEM_MAG_SIZE;
+		assert((objs = kmalloc(n * sizeof(objs[0]), ALLOC_ZERO)));
+		for (i = 0; i < n; i++) {
+			// every size that maps to this class
+			assert((p = kmalloc(kc->kc_size / 2 + 1 + i % (kc->kc_size / 2), 0)));
+			assert(((uintptr_t) p & 15) == 0);
+			assert((sl = slab_of(p)) && sl->sl_cache == kc);
+			assert(p >= (char *) sl + SLAB_HDR);
+			assert(p + kc->kc_size <= (char *) sl + (PGSIZE << kc->kc_order));
+			memset(p, i, kc->kc_size);
+			objs[i] = p;
+		}
+		assert(kc->kc_nslabs >= 3);
+
+		// nothing handed out twice, nothing overwritten
+		for (i = 0; i < n; i++)
+			for (j = 0; j < kc->kc_size; j++)
+				assert(objs[i][j] == (char) i);
+
+		// the object freed last is the one allocated next
+		kfree(objs[n - 1]);
+		assert((p = kmalloc(kc->kc_size, ALLOC_ZERO)) == objs[n - 1]);
+		for (j = 0; j < kc->kc_size; j++)
+			assert(p[j] == 0);
+
+		for (i = 0; i < n; i++)
+			kfree(objs[i]);
+		kfree(objs);
+		assert(kc->kc_nempty <= 1);
+		kmem_drain_all();
+		assert(kc->kc_nslabs == 0 && kc->kc_nempty == 0);
+	}
+
+	// large allocations are whole pages
+	assert((p = kmalloc(KMALLOC_MAX + 1, 0)) && PGOFF(p) == 0);
+	assert(pa2page(PADDR(p))->pp_order == 0);
+	assert((q = kmalloc(3 * PGSIZE, ALLOC_ZERO)) && PGOFF(q) == 0);
+	assert(pa2page(PADDR(q))->pp_order == 2);
+	assert(kmem_large_pages == 5);
+	for (j = 0; j < 3 * PGSIZE; j++)
+		assert(q[j] == 0);
+	kfree(p);
+	kfree(q);
+	assert(kmem_large_pages == 0);
+
+	cprintf("check_kmalloc() succeeded!\n");
+}
@@ -0,0 +1,29 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_KMALLOC_H
+#define JOS_KERN_KMALLOC_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+// kmalloc serves requests of up to KMALLOC_MAX bytes from caches of
+// same-sized objects, one per power-of-two size class starting at
+// KMALLOC_MIN.  Larger requests get whole pages from page_alloc_order.
+#define KMALLOC_MIN		16
+#define KMALLOC_MAX		2048
+#define KMALLOC_NCLASSES	8	// 16, 32, ..., 2048 bytes
+
+// Each CPU keeps a magazine of up to KMEM_MAG_SIZE free objects per
+// size class and trades KMEM_MAG_BATCH at a time with the slabs.
+#define KMEM_MAG_SIZE		32
+#define KMEM_MAG_BATCH		16
+
+void	kmalloc_init(void);
+void   *kmalloc(size_t size, int alloc_flags);
+void	kfree(void *va);
+void	kmem_drain_all(void);
+void	kmem_print_stats(void);
+
+#endif /* !JOS_KERN_KMALLOC_H */
@@ -4,15 +4,16 @@
 #include "dwarf_error.h"
 #include "dwarf_define.h"
 #include "dwarf.h"
+#include <kern/pmap.h>
+#include <kern/kmalloc.h>
 
 //#define FRAME_DEBUG
 #define printf cprintf
 
 extern Dwarf_Debug dbg;
 
-static int _dwarf_get_next_fde(Dwarf_Debug, int , Dwarf_Error *, Dwarf_Fde);
-
 Dwarf_Section debug_frame_sec = {".eh_frame", 0, 0, 0};
+Dwarf_Section debug_frame_hdr_sec = {".eh_frame_hdr", 0, 0, 0};
 int is_eh_frame = 1;
 Dwarf_Regtable3 global_rt_table = {{0}};
 Dwarf_Regtable_Entry3 global_rules[DW_FRAME_LAST_REG_NUM];
@@ -38,9 +39,15 @@ uint64_t
 _dwarf_decode_uleb128(uint8_t **dp);
 
 
+static int
+_dwarf_frame_set_cie(Dwarf_Debug dbg, Dwarf_Section *ds,
+    Dwarf_Unsigned *off, Dwarf_Cie ret_cie, Dwarf_Error *error);
 static int
 _dwarf_frame_set_fde(Dwarf_Debug dbg, Dwarf_Fde retfde, Dwarf_Section *ds,
     Dwarf_Unsigned *off, int eh_frame, Dwarf_Cie cie, Dwarf_Error *error);
+static int
+_dwarf_frame_read_lsb_encoded(Dwarf_Debug dbg, uint64_t *val, uint8_t *data,
+    uint64_t *offsetp, uint8_t encode, Dwarf_Addr pc, Dwarf_Error *error);
 
 int
 _dwarf_frame_section_load_eh(Dwarf_Debug dbg, Dwarf_Error *error);
@@ -60,34 +67,271 @@ _dwarf_frame_params_init(Dwarf_Debug dbg)
 }
 
 
+/*
+ * FDE search table: the initial location and .eh_frame offset of every
+ * FDE, sorted by initial location.  When the linker provides an
+ * .eh_frame_hdr, its binary search table is used in place; otherwise
+ * fde_table is built by walking .eh_frame once.  If neither is
+ * possible, lookups walk .eh_frame.
+ */
+enum {
+	FDE_TABLE_UNKNOWN,	/* Not set up yet. */
+	FDE_TABLE_HDR,		/* Search fde_hdr_table. */
+	FDE_TABLE_ARRAY,	/* Search fde_table. */
+	FDE_TABLE_NONE,		/* Walk .eh_frame. */
+};
+
+struct _Dwarf_FdeEnt {
+	Dwarf_Addr	fe_initloc;	/* FDE initial location. */
+	uint64_t	fe_offset;	/* Offset of the FDE in .eh_frame. */
+};
+
+static int fde_table_kind;
+static int32_t *fde_hdr_table;		/* (initloc, FDE) pairs, datarel. */
+static struct _Dwarf_FdeEnt *fde_table;
+static uint64_t fde_table_len, fde_table_cap;
+
+/* Parse the FDE at offset off in ds, and the CIE it points to. */
+static int
+_dwarf_frame_fde_parse(Dwarf_Section *ds, uint64_t off, Dwarf_Fde fde,
+    Dwarf_Cie cie, Dwarf_Error *error)
+{
+	uint64_t p, cieoff, length;
+	int ret;
+
+	p = off;
+	length = dbg->read(ds->ds_data, &p, 4);
+	if (length == 0xffffffff)
+		p += 8;
+	cieoff = p;
+	cieoff -= dbg->read(ds->ds_data, &p, 4);
+	if (cieoff >= ds->ds_size) {
+		DWARF_SET_ERROR(dbg, error, DW_DLE_NO_CIE_FOR_FDE);
+		return (DW_DLE_NO_CIE_FOR_FDE);
+	}
+
+	memset(cie, 0, sizeof(struct _Dwarf_Cie));
+	ret = _dwarf_frame_set_cie(dbg, ds, &cieoff, cie, error);
+	if (ret != DW_DLE_NONE)
+		return (ret);
+
+	memset(fde, 0, sizeof(struct _Dwarf_Fde));
+	fde->fde_cie = cie;
+	return (_dwarf_frame_set_fde(dbg, fde, ds, &off, 1, cie, error));
+}
+
+static int
+_dwarf_frame_fde_table_add(Dwarf_Addr initloc, uint64_t off)
+{
+	struct _Dwarf_FdeEnt *fe;
+	uint64_t i, cap;
+
+	if (fde_table_len == fde_table_cap) {
+		cap = fde_table_cap ? 2 * fde_table_cap : 256;
+		if ((fe = kmalloc(cap * sizeof(*fe), 0)) == NULL)
+			return (DW_DLE_MEMORY);
+		memmove(fe, fde_table, fde_table_len * sizeof(*fe));
+		kfree(fde_table);
+		fde_table = fe;
+		fde_table_cap = cap;
+	}
+
+	/* Insertion sort.  FDEs mostly come in address order. */
+	for (i = fde_table_len; i > 0 && fde_table[i - 1].fe_initloc > initloc;
+	    i--)
+		fde_table[i] = fde_table[i - 1];
+	fde_table[i].fe_initloc = initloc;
+	fde_table[i].fe_offset = off;
+	fde_table_len++;
+
+	return (DW_DLE_NONE);
+}
+
+/*
+ * Walk .eh_frame.  If build is set, add every FDE to fde_table;
+ * otherwise stop at the FDE that covers pc.
+ */
+static int
+_dwarf_frame_fde_walk(Dwarf_Section *ds, int build, Dwarf_Addr pc,
+    Dwarf_Fde fde, Dwarf_Cie cie, Dwarf_Error *error)
+{
+	uint64_t off, entry_off, next, length;
+	int ret;
+
+	for (off = 0; off < ds->ds_size; off = next) {
+		entry_off = off;
+		length = dbg->read(ds->ds_data, &off, 4);
+		if (length == 0xffffffff)
+			length = dbg->read(ds->ds_data, &off, 8);
+		if (length == 0)
+			break;		/* Terminator. */
+		if (length > ds->ds_size - off) {
+			DWARF_SET_ERROR(dbg, error,
+			    DW_DLE_DEBUG_FRAME_LENGTH_BAD);
+			return (DW_DLE_DEBUG_FRAME_LENGTH_BAD);
+		}
+		next = off + length;
+
+		/* GNU .eh_frame uses CIE id 0. */
+		if (dbg->read(ds->ds_data, &off, 4) == 0)
+			continue;
+
+		ret = _dwarf_frame_fde_parse(ds, entry_off, fde, cie, error);
+		if (ret != DW_DLE_NONE)
+			return (ret);
+		if (build) {
+			ret = _dwarf_frame_fde_table_add(fde->fde_initloc,
+			    entry_off);
+			if (ret != DW_DLE_NONE)
+				return (ret);
+		} else if (pc >= fde->fde_initloc &&
+		    pc < fde->fde_initloc + fde->fde_adrange)
+			return (DW_DLE_NONE);
+	}
+
+	if (build)
+		return (DW_DLE_NONE);
+	DWARF_SET_ERROR(dbg, error, DW_DLE_NO_ENTRY);
+	return (DW_DLE_NO_ENTRY);
+}
+
+/* Use .eh_frame_hdr's table, if it has one that describes ds. */
+static int
+_dwarf_frame_hdr_init(Dwarf_Section *hds, Dwarf_Section *ds)
+{
+	uint64_t off, eh_frame_ptr, fde_count;
+	uint8_t ptr_enc, count_enc, table_enc;
+
+	if (hds->ds_size < 4 || hds->ds_data[0] != 1)
+		return (DW_DLE_NO_ENTRY);
+	ptr_enc = hds->ds_data[1];
+	count_enc = hds->ds_data[2];
+	table_enc = hds->ds_data[3];
+	off = 4;
+
+	eh_frame_ptr = 0;
+	fde_count = 0;
+	if (_dwarf_frame_read_lsb_encoded(dbg, &eh_frame_ptr, hds->ds_data,
+	    &off, ptr_enc, hds->ds_addr + off, NULL) != DW_DLE_NONE ||
+	    _dwarf_frame_read_lsb_encoded(dbg, &fde_count, hds->ds_data,
+	    &off, count_enc, hds->ds_addr + off, NULL) != DW_DLE_NONE)
+		return (DW_DLE_NO_ENTRY);
+
+	/* Only the table format ld writes: 4-byte header-relative pairs. */
+	if (eh_frame_ptr != ds->ds_addr ||
+	    table_enc != (DW_EH_PE_datarel | DW_EH_PE_sdata4) ||
+	    off + fde_count * 8 > hds->ds_size)
+		return (DW_DLE_NO_ENTRY);
+
+	fde_hdr_table = (int32_t *) (hds->ds_data + off);
+	fde_table_len = fde_count;
+	return (DW_DLE_NONE);
+}
+
+static void
+_dwarf_frame_fde_table_init(Dwarf_Section *ds)
+{
+	struct _Dwarf_Fde fde;
+	struct _Dwarf_Cie cie;
+
+	_dwarf_find_section_enhanced(&debug_frame_hdr_sec);
+	if (debug_frame_hdr_sec.ds_data != NULL &&
+	    _dwarf_frame_hdr_init(&debug_frame_hdr_sec, ds) == DW_DLE_NONE) {
+		fde_table_kind = FDE_TABLE_HDR;
+		return;
+	}
+
+	if (_dwarf_frame_fde_walk(ds, 1, 0, &fde, &cie, NULL) == DW_DLE_NONE) {
+		fde_table_kind = FDE_TABLE_ARRAY;
+		return;
+	}
+
+	kfree(fde_table);
+	fde_table = NULL;
+	fde_table_len = fde_table_cap = 0;
+	fde_table_kind = FDE_TABLE_NONE;
+}
+
+/*
+ * Find the offset in .eh_frame of the last FDE starting at or below pc,
+ * which is the only one that can cover it.
+ */
+static int
+_dwarf_frame_fde_search(Dwarf_Section *ds, Dwarf_Addr pc, uint64_t *offp)
+{
+	Dwarf_Addr hdr, initloc;
+	uint64_t lo, hi, mid;
+
+	hdr = debug_frame_hdr_sec.ds_addr;
+	lo = 0;
+	hi = fde_table_len;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (fde_table_kind == FDE_TABLE_HDR)
+			initloc = hdr + fde_hdr_table[2 * mid];
+		else
+			initloc = fde_table[mid].fe_initloc;
+		if (initloc <= pc)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == 0)
+		return (DW_DLE_NO_ENTRY);
+
+	if (fde_table_kind == FDE_TABLE_HDR)
+		*offp = hdr + fde_hdr_table[2 * (lo - 1) + 1] - ds->ds_addr;
+	else
+		*offp = fde_table[lo - 1].fe_offset;
+	return (DW_DLE_NONE);
+}
+
+/*
+ * Find the FDE covering pc, filling in *ret_fde and the CIE it uses in
+ * *cie.  Uses no state besides the FDE search table, so lookups can
+ * nest and be repeated in any order.
+ */
 int
 dwarf_get_fde_at_pc(Dwarf_Addr pc,
     Dwarf_Addr *lopc, Dwarf_Addr *hipc, struct _Dwarf_Fde *ret_fde, Dwarf_Cie cie, Dwarf_Error *error)
 {
-    Dwarf_Fde fde = ret_fde;
-	memset(fde, 0, sizeof(struct _Dwarf_Fde));
-	fde->fde_cie = cie;
-	
-        if (ret_fde == NULL || lopc == NULL || hipc == NULL) {
-                return (DW_DLV_ERROR);
-        }
+	Dwarf_Section *ds = &debug_frame_sec;
+	Dwarf_Fde fde = ret_fde;
+	uint64_t off;
+	int ret;
 
-        while(dbg->dbg_eh_offset < dbg->dbg_eh_size) {
-                if (_dwarf_get_next_fde(dbg, is_eh_frame, error, fde) < 0)
-				{
-		    		return DW_DLV_NO_ENTRY;
-				}
-                if (pc >= fde->fde_initloc && pc < fde->fde_initloc +
-                    fde->fde_adrange) {
-                        *lopc = fde->fde_initloc;
-                        *hipc = fde->fde_initloc + fde->fde_adrange - 1;
-
-                        return (DW_DLV_OK);
-                }
-        }
+	if (ret_fde == NULL || cie == NULL || lopc == NULL || hipc == NULL) {
+		DWARF_SET_ERROR(dbg, error, DW_DLE_ARGUMENT);
+		return (DW_DLV_ERROR);
+	}
+
+	if (ds->ds_data == NULL || ds->ds_size == 0) {
+		DWARF_SET_ERROR(dbg, error, DW_DLE_NO_ENTRY);
+		return (DW_DLV_NO_ENTRY);
+	}
+
+	if (fde_table_kind == FDE_TABLE_UNKNOWN)
+		_dwarf_frame_fde_table_init(ds);
+
+	if (fde_table_kind == FDE_TABLE_NONE)
+		ret = _dwarf_frame_fde_walk(ds, 0, pc, fde, cie, error);
+	else if ((ret = _dwarf_frame_fde_search(ds, pc, &off)) ==
+	    DW_DLE_NONE &&
+	    (ret = _dwarf_frame_fde_parse(ds, off, fde, cie, error)) ==
+	    DW_DLE_NONE &&
+	    pc >= fde->fde_initloc + fde->fde_adrange)
+		ret = DW_DLE_NO_ENTRY;
+
+	if (ret == DW_DLE_NO_ENTRY) {
+		DWARF_SET_ERROR(dbg, error, DW_DLE_NO_ENTRY);
+		return (DW_DLV_NO_ENTRY);
+	}
+	if (ret != DW_DLE_NONE)
+		return (DW_DLV_ERROR);
 
-        DWARF_SET_ERROR(dbg, error, DW_DLE_NO_ENTRY);
-        return (DW_DLV_NO_ENTRY);
+	*lopc = fde->fde_initloc;
+	*hipc = fde->fde_initloc + fde->fde_adrange - 1;
+	return (DW_DLV_OK);
 }
 
 int
@@ -134,7 +378,8 @@ _dwarf_frame_regtable_copy(Dwarf_Debug dbg, Dwarf_Regtable3 **dest,
 static int
 _dwarf_frame_run_inst(Dwarf_Debug dbg, Dwarf_Regtable3 *rt, uint8_t *insts,
     Dwarf_Unsigned len, Dwarf_Unsigned caf, Dwarf_Signed daf, Dwarf_Addr pc,
-    Dwarf_Addr pc_req, Dwarf_Addr *row_pc, Dwarf_Error *error)
+    Dwarf_Addr pc_req, Dwarf_Addr *row_pc, Dwarf_Addr *row_end,
+    Dwarf_Error *error)
 {
         Dwarf_Regtable3 *init_rt, *saved_rt;
         uint8_t *p, *pe;
@@ -233,13 +478,11 @@ _dwarf_frame_run_inst(Dwarf_Debug dbg, Dwarf_Regtable3 *rt, uint8_t *insts,
 
                 switch (low6) {
                 case DW_CFA_set_loc:
-			printf("dbg pointersize :%x\n",dbg->dbg_pointer_size);
                         pc = dbg->decode(&p, dbg->dbg_pointer_size);
 #ifdef FRAME_DEBUG
                         printf("DW_CFA_set_loc(pc=%#jx)\n", pc);
 #endif
                         if (pc_req < pc)
-				printf("Program done\n");
                                 goto program_done;
                         break;
                 case DW_CFA_advance_loc1:
@@ -484,6 +727,13 @@ _dwarf_frame_run_inst(Dwarf_Debug dbg, Dwarf_Regtable3 *rt, uint8_t *insts,
 
 program_done:
 
+        /*
+         * If an advance took us past pc_req, the row for pc_req ends
+         * where the next one starts; otherwise it runs to the end.
+         */
+        if (row_end != NULL)
+                *row_end = pc > pc_req ? pc : ~0ULL;
+
 /*        free(init_rt->rt3_rules);
         free(init_rt);
         if (saved_rt) {
@@ -502,12 +752,13 @@ program_done:
 
 int
 _dwarf_frame_get_internal_table(Dwarf_Fde fde, Dwarf_Addr pc_req,
-    Dwarf_Regtable3 **ret_rt, Dwarf_Addr *ret_row_pc, Dwarf_Error *error)
+    Dwarf_Regtable3 **ret_rt, Dwarf_Addr *ret_row_pc, Dwarf_Addr *ret_row_end,
+    Dwarf_Error *error)
 {
         //Dwarf_Debug dbg;
         Dwarf_Cie cie;
         Dwarf_Regtable3 *rt;
-        Dwarf_Addr row_pc;
+        Dwarf_Addr row_pc, row_end;
         int i, ret;
 
         assert(ret_rt != NULL);
@@ -531,20 +782,25 @@ _dwarf_frame_get_internal_table(Dwarf_Fde fde, Dwarf_Addr pc_req,
         assert(cie != NULL);
         ret = _dwarf_frame_run_inst(dbg, rt, cie->cie_initinst,
             cie->cie_instlen, cie->cie_caf, cie->cie_daf, 0, ~0ULL,
-            &row_pc, error);
+            &row_pc, NULL, error);
         if (ret != DW_DLE_NONE)
                 return (ret);
         /* Run instructions in FDE. */
+        row_end = ~0ULL;
         if (pc_req >= fde->fde_initloc) {
                 ret = _dwarf_frame_run_inst(dbg, rt, fde->fde_inst,
                     fde->fde_instlen, cie->cie_caf, cie->cie_daf,
-                    fde->fde_initloc, pc_req, &row_pc, error);
+                    fde->fde_initloc, pc_req, &row_pc, &row_end, error);
                 if (ret != DW_DLE_NONE)
                         return (ret);
         }
+        if (row_end > fde->fde_initloc + fde->fde_adrange)
+                row_end = fde->fde_initloc + fde->fde_adrange;
 
         *ret_rt = rt;
         *ret_row_pc = row_pc;
+        if (ret_row_end != NULL)
+                *ret_row_end = row_end;
 
         return (DW_DLE_NONE);
 }
@@ -576,7 +832,7 @@ dwarf_get_fde_info_for_all_regs(Dwarf_Fde fde, Dwarf_Addr pc_requested,
         }
 
         ret = _dwarf_frame_get_internal_table(fde, pc_requested, &rt, &pc,
-            error);
+            NULL, error);
         if (ret != DW_DLE_NONE)
 		{
 
@@ -619,6 +875,52 @@ dwarf_get_fde_info_for_all_regs(Dwarf_Fde fde, Dwarf_Addr pc_requested,
         return (DW_DLV_OK);
 }
 
+/*
+ * Compute the rule row covering pc_requested into reg_table, whose
+ * rt3_rules must have room for rt3_reg_table_size rules.  The row is
+ * valid for [*row_pc, *row_end).
+ */
+int
+dwarf_get_fde_info_for_all_regs3(Dwarf_Fde fde, Dwarf_Addr pc_requested,
+    Dwarf_Regtable3 *reg_table, Dwarf_Addr *row_pc, Dwarf_Addr *row_end,
+    Dwarf_Error *error)
+{
+        Dwarf_Regtable3 *rt;
+        int i, ret;
+
+        if (fde == NULL || reg_table == NULL || row_pc == NULL ||
+            row_end == NULL) {
+                DWARF_SET_ERROR(dbg, error, DW_DLE_ARGUMENT);
+                return (DW_DLV_ERROR);
+        }
+
+        assert(dbg != NULL);
+
+        if (pc_requested < fde->fde_initloc ||
+            pc_requested >= fde->fde_initloc + fde->fde_adrange) {
+                DWARF_SET_ERROR(dbg, error, DW_DLE_PC_NOT_IN_FDE_RANGE);
+                return (DW_DLV_ERROR);
+        }
+
+        ret = _dwarf_frame_get_internal_table(fde, pc_requested, &rt, row_pc,
+            row_end, error);
+        if (ret != DW_DLE_NONE)
+                return (DW_DLV_ERROR);
+
+        memcpy(&reg_table->rt3_cfa_rule, &rt->rt3_cfa_rule,
+            sizeof(Dwarf_Regtable_Entry3));
+        for (i = 0; i < reg_table->rt3_reg_table_size; i++) {
+                if (i < rt->rt3_reg_table_size)
+                        memcpy(&reg_table->rt3_rules[i], &rt->rt3_rules[i],
+                            sizeof(Dwarf_Regtable_Entry3));
+                else
+                        reg_table->rt3_rules[i].dw_regnum =
+                            dbg->dbg_frame_undefined_value;
+        }
+
+        return (DW_DLV_OK);
+}
+
 static int
 _dwarf_frame_read_lsb_encoded(Dwarf_Debug dbg, uint64_t *val, uint8_t *data,
     uint64_t *offsetp, uint8_t encode, Dwarf_Addr pc, Dwarf_Error *error)
@@ -974,67 +1276,6 @@ _dwarf_frame_interal_table_init(Dwarf_Debug dbg, Dwarf_Error *error)
 }
 
 
-static int
-_dwarf_get_next_fde(Dwarf_Debug dbg,
-                    int eh_frame, Dwarf_Error *error, Dwarf_Fde ret_fde)
-{
-	Dwarf_Section *ds = &debug_frame_sec; 
-	uint64_t length, offset, cie_id, entry_off;
-	int dwarf_size, i, ret=-1;
-
-	offset = dbg->dbg_eh_offset;
-	if (offset < ds->ds_size) {
-		entry_off = offset;
-		length = dbg->read(ds->ds_data, &offset, 4);
-		if (length == 0xffffffff) {
-			dwarf_size = 8;
-			length = dbg->read(ds->ds_data, &offset, 8);
-		} else
-			dwarf_size = 4;
-
-		if (length > ds->ds_size - offset ||
-		    (length == 0 && !eh_frame)) {
-			DWARF_SET_ERROR(dbg, error,
-			    DW_DLE_DEBUG_FRAME_LENGTH_BAD);
-			return (DW_DLE_DEBUG_FRAME_LENGTH_BAD);
-		}
-
-		/* Check terminator for .eh_frame */
-		if (eh_frame && length == 0)
-			return(-1);
-
-		cie_id = dbg->read(ds->ds_data, &offset, dwarf_size);
-
-		if (eh_frame) {
-			/* GNU .eh_frame use CIE id 0. */
-			if (cie_id == 0)
-				ret = _dwarf_frame_set_cie(dbg, ds,
-				    &entry_off, ret_fde->fde_cie, error);
-			else
-				ret = _dwarf_frame_set_fde(dbg,ret_fde, ds,
-				    &entry_off, 1, ret_fde->fde_cie, error);
-		} else {
-			/* .dwarf_frame use CIE id ~0 */
-			if ((dwarf_size == 4 && cie_id == ~0U) ||
-			    (dwarf_size == 8 && cie_id == ~0ULL))
-				ret = _dwarf_frame_set_cie(dbg, ds,
-				    &entry_off, ret_fde->fde_cie, error);
-			else
-				ret = _dwarf_frame_set_fde(dbg, ret_fde, ds,
-				    &entry_off, 0, ret_fde->fde_cie, error);
-		}
-
-		if (ret != DW_DLE_NONE)
-			return(-1);
-
-		offset = entry_off;
-		dbg->dbg_eh_offset = offset;
-	}
-
-	return (0);
-}
-
-
 Dwarf_Half
 dwarf_set_frame_cfa_value(Dwarf_Debug dbg, Dwarf_Half value)
 {
@@ -31,6 +31,8 @@
 #include "dwarf_define.h"
 #include "dwarf_error.h"
 #include "dwarf.h"
+#include <kern/pmap.h>
+#include <kern/kmalloc.h>
 
 #include "dwarf_lineno.h"
 
@@ -47,6 +49,149 @@ int64_t
 _dwarf_decode_sleb128(uint8_t **dp);
 int  _dwarf_find_section_enhanced(Dwarf_Section *ds);
 
+/*
+ * Decoded line tables.  The first lookup in a CU runs its whole line
+ * number program once, collecting every row into lt_rows, sorted by
+ * address; later lookups binary search that array.  Tables are kept in
+ * a small hash keyed by their offset in .debug_line.
+ */
+#define LINE_TABLE_BUCKETS      64
+
+struct _Dwarf_LineRow {
+    Dwarf_Addr      lr_addr;        /* Line address. */
+    uint32_t        lr_lineno;      /* Line number. */
+    uint32_t        lr_fileno : 12, /* File number. */
+                    lr_column : 17, /* Column number. */
+                    lr_bblock : 1,  /* Basic block flag. */
+                    lr_stmt : 1,    /* Begin statement flag. */
+                    lr_endseq : 1;  /* End sequence flag. */
+};
+
+struct _Dwarf_LineTable {
+    struct _Dwarf_LineTable *lt_next;   /* Next table in the bucket. */
+    uint64_t        lt_offset;      /* Offset in .debug_line. */
+    struct _Dwarf_LineRow *lt_rows; /* Rows sorted by address. */
+    uint64_t        lt_nrows;
+    uint64_t        lt_cap;
+};
+
+static struct _Dwarf_LineTable *line_tables[LINE_TABLE_BUCKETS];
+static struct _Dwarf_LineTable *line_table_last;
+
+static int
+_dwarf_lineno_table_add(struct _Dwarf_LineTable *lt, Dwarf_Line ln)
+{
+    struct _Dwarf_LineRow *lr;
+    uint64_t i, cap;
+
+    if (lt->lt_nrows == lt->lt_cap) {
+        cap = lt->lt_cap ? 2 * lt->lt_cap : 256;
+        if ((lr = kmalloc(cap * sizeof(*lr), 0)) == NULL)
+            return (DW_DLE_MEMORY);
+        memmove(lr, lt->lt_rows, lt->lt_nrows * sizeof(*lr));
+        kfree(lt->lt_rows);
+        lt->lt_rows = lr;
+        lt->lt_cap = cap;
+    }
+
+    /*
+     * Insertion sort.  Sequences mostly come in address order, so this
+     * rarely moves anything.  An end-of-sequence row goes before other
+     * rows at its address, which start the next sequence.
+     */
+    for (i = lt->lt_nrows; i > 0; i--) {
+        lr = &lt->lt_rows[i - 1];
+        if (lr->lr_addr < ln->ln_addr || (lr->lr_addr == ln->ln_addr &&
+            (lr->lr_endseq || !ln->ln_endseq)))
+            break;
+        lt->lt_rows[i] = *lr;
+    }
+    lr = &lt->lt_rows[i];
+    lr->lr_addr = ln->ln_addr;
+    lr->lr_lineno = ln->ln_lineno;
+    lr->lr_fileno = ln->ln_fileno;
+    lr->lr_column = ln->ln_column;
+    lr->lr_bblock = ln->ln_bblock;
+    lr->lr_stmt = ln->ln_stmt;
+    lr->lr_endseq = ln->ln_endseq;
+    lt->lt_nrows++;
+
+    return (DW_DLE_NONE);
+}
+
+static void
+_dwarf_lineno_row_copy(struct _Dwarf_LineRow *lr, Dwarf_Line ln)
+{
+    ln->ln_addr = lr->lr_addr;
+    ln->ln_symndx = 0;
+    ln->ln_fileno = lr->lr_fileno;
+    ln->ln_lineno = lr->lr_lineno;
+    ln->ln_column = lr->lr_column;
+    ln->ln_bblock = lr->lr_bblock;
+    ln->ln_stmt = lr->lr_stmt;
+    ln->ln_endseq = lr->lr_endseq;
+}
+
+/* Return the index of the first row whose address is above pc. */
+static uint64_t
+_dwarf_lineno_table_upper(struct _Dwarf_LineTable *lt, Dwarf_Addr pc)
+{
+    uint64_t lo, hi, mid;
+
+    lo = 0;
+    hi = lt->lt_nrows;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (lt->lt_rows[mid].lr_addr <= pc)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return (lo);
+}
+
+/*
+ * Find the line table for the CU whose DIE is die, decoding it if need.
+ * Returns DW_DLE_MEMORY if there is no memory to keep the table.
+ */
+static int
+_dwarf_lineno_table_get(Dwarf_Die *die, uint64_t offset,
+    struct _Dwarf_LineTable **ltp, Dwarf_Error *error)
+{
+    struct _Dwarf_LineTable *lt;
+    _Dwarf_LineInfo li;
+    uint64_t b;
+    int ret;
+
+    if (line_table_last != NULL && line_table_last->lt_offset == offset) {
+        *ltp = line_table_last;
+        return (DW_DLE_NONE);
+    }
+
+    b = offset % LINE_TABLE_BUCKETS;
+    for (lt = line_tables[b]; lt != NULL; lt = lt->lt_next)
+        if (lt->lt_offset == offset)
+            break;
+    if (lt == NULL) {
+        if ((lt = kmalloc(sizeof(*lt), ALLOC_ZERO)) == NULL)
+            return (DW_DLE_MEMORY);
+        lt->lt_offset = offset;
+        memset(&li, 0, sizeof(li));
+        li.li_table = lt;
+        if ((ret = _dwarf_lineno_init(die, offset, &li, 0, error)) !=
+            DW_DLE_NONE) {
+            kfree(lt->lt_rows);
+            kfree(lt);
+            return (ret);
+        }
+        lt->lt_next = line_tables[b];
+        line_tables[b] = lt;
+    }
+    line_table_last = lt;
+    *ltp = lt;
+    return (DW_DLE_NONE);
+}
+
 
 
 
@@ -77,7 +222,7 @@ _dwarf_lineno_run_program(Dwarf_CU *cu, Dwarf_LineInfo li, uint8_t *p,
 
 #define APPEND_ROW                      \
     do {                            \
-        if (pc < address) {               \
+        if (li->li_table == NULL && pc < address) {   \
 			return DW_DLE_NONE;			\
         }                       \
         ln->ln_addr   = address;            \
@@ -89,6 +234,12 @@ _dwarf_lineno_run_program(Dwarf_CU *cu, Dwarf_LineInfo li, uint8_t *p,
         ln->ln_stmt   = is_stmt;            \
         ln->ln_endseq = end_sequence;           \
         li->li_lnlen++;                 \
+        if (li->li_table != NULL &&             \
+            (ret = _dwarf_lineno_table_add(li->li_table, ln)) != \
+            DW_DLE_NONE) {                      \
+            DWARF_SET_ERROR(dbg, error, ret);   \
+            goto prog_fail;                     \
+        }                                       \
     } while(0)
 
 #define LINE(x) (li->li_lbase + (((x) - li->li_opbase) % li->li_lrange))
@@ -116,6 +267,8 @@ _dwarf_lineno_run_program(Dwarf_CU *cu, Dwarf_LineInfo li, uint8_t *p,
             case DW_LNE_end_sequence:
                 p++;
                 end_sequence = 1;
+                if (li->li_table != NULL)
+                    APPEND_ROW;
                 RESET_REGISTERS;
                 break;
             case DW_LNE_set_address:
@@ -426,6 +579,9 @@ dwarf_srclines(Dwarf_Die *die, Dwarf_Line linebuf, Dwarf_Addr pc, Dwarf_Error *e
 {
     _Dwarf_LineInfo li;
     Dwarf_Attribute *at;
+    struct _Dwarf_LineTable *lt;
+    uint64_t i;
+    int ret;
 
 	assert(die);
 	assert(linebuf);
@@ -437,6 +593,21 @@ dwarf_srclines(Dwarf_Die *die, Dwarf_Line linebuf, Dwarf_Addr pc, Dwarf_Error *e
         return (DW_DLV_NO_ENTRY);
     }
 
+    ret = _dwarf_lineno_table_get(die, at->u[0].u64, &lt, error);
+    if (ret == DW_DLE_NONE) {
+        /* The row before the first one above pc covers pc. */
+        i = _dwarf_lineno_table_upper(lt, pc);
+        if (i == 0 || lt->lt_rows[i - 1].lr_endseq) {
+            DWARF_SET_ERROR(dbg, error, DW_DLE_NO_ENTRY);
+            return (DW_DLV_NO_ENTRY);
+        }
+        _dwarf_lineno_row_copy(&lt->lt_rows[i - 1], linebuf);
+        return (DW_DLV_OK);
+    }
+    if (ret != DW_DLE_MEMORY)
+        return (DW_DLV_ERROR);
+
+    /* No memory for the table: run the program up to pc. */
     if (_dwarf_lineno_init(die, at->u[0].u64, &li, pc, error) !=
         DW_DLE_NONE)
 	{
@@ -447,3 +618,44 @@ dwarf_srclines(Dwarf_Die *die, Dwarf_Line linebuf, Dwarf_Addr pc, Dwarf_Error *e
     return (DW_DLV_OK);
 }
 
+/*
+ * Copy the rows of die's CU that start in [lo, hi) to linebuf, in
+ * address order, stopping after maxlines.  *nlines is set to the
+ * number of rows in the range, which may be more than were copied.
+ * End-of-sequence rows are left out.
+ */
+int
+dwarf_srclines_range(Dwarf_Die *die, Dwarf_Addr lo, Dwarf_Addr hi,
+    Dwarf_Line linebuf, Dwarf_Unsigned maxlines, Dwarf_Unsigned *nlines,
+    Dwarf_Error *error)
+{
+    Dwarf_Attribute *at;
+    struct _Dwarf_LineTable *lt;
+    uint64_t i, n;
+
+	assert(die);
+	assert(nlines);
+
+    *nlines = 0;
+    if ((at = _dwarf_attr_find(die, DW_AT_stmt_list)) == NULL) {
+        DWARF_SET_ERROR(dbg, error, DW_DLE_NO_ENTRY);
+        return (DW_DLV_NO_ENTRY);
+    }
+
+    if (_dwarf_lineno_table_get(die, at->u[0].u64, &lt, error) !=
+        DW_DLE_NONE)
+        return (DW_DLV_ERROR);
+
+    /* Skip to the first row at or above lo. */
+    i = lo ? _dwarf_lineno_table_upper(lt, lo - 1) : 0;
+    for (n = 0; i < lt->lt_nrows && lt->lt_rows[i].lr_addr < hi; i++) {
+        if (lt->lt_rows[i].lr_endseq)
+            continue;
+        if (n < maxlines)
+            _dwarf_lineno_row_copy(&lt->lt_rows[i], &linebuf[n]);
+        n++;
+    }
+    *nlines = n;
+
+    return (DW_DLV_OK);
+}
@@ -32,6 +32,8 @@
 #include "dwarf_define.h"
 #include "dwarf_error.h"
 #include "dwarf.h"
+#include <kern/pmap.h>
+#include <kern/kmalloc.h>
 
 
 Dwarf_Attribute* _dwarf_attr_find(Dwarf_Die *die, uint16_t attr);
@@ -469,10 +471,184 @@ _dwarf_abbrev_parse(Dwarf_Debug dbg, Dwarf_CU cu, Dwarf_Unsigned *offset,
     return DW_DLV_OK;
 }
 
+/*
+ * Abbreviation tables.  Each table is parsed once, the first time a DIE
+ * that uses it is decoded, and is shared by every CU with the same
+ * debug_abbrev_offset.  Codes are normally numbered 1, 2, 3, ... so
+ * they index at_bycode directly; a code too large for that array goes
+ * in a small open-addressing hash table instead.
+ */
+#define ABBREV_TABLE_BUCKETS    64
+
+struct _Dwarf_AbbrevEnt {
+    uint64_t        ae_entry;       /* Abbrev code. */
+    uint64_t        ae_tag;         /* Tag: DW_TAG_ */
+    uint64_t        ae_offset;      /* Offset in abbrev section. */
+    uint64_t        ae_length;      /* Length of this abbrev entry. */
+    uint64_t        ae_atnum;       /* Number of attribute defines. */
+    uint8_t         ae_children;    /* DW_CHILDREN_no or DW_CHILDREN_yes */
+    Dwarf_AttrDef   *ae_attrdef;    /* ae_atnum attribute defines. */
+};
+
+struct _Dwarf_AbbrevTable {
+    struct _Dwarf_AbbrevTable *at_next; /* Next table in the bucket. */
+    uint64_t        at_offset;      /* Offset in abbrev section. */
+    struct _Dwarf_AbbrevEnt *at_ents;   /* Entries in section order. */
+    uint64_t        at_nents;
+    struct _Dwarf_AbbrevEnt **at_bycode; /* Codes below at_ncodes. */
+    uint64_t        at_ncodes;
+    struct _Dwarf_AbbrevEnt **at_hash;  /* Codes from at_ncodes up. */
+    uint64_t        at_hashsize;    /* Power of two, or 0. */
+    Dwarf_AttrDef   *at_attrdef;    /* Storage for all ae_attrdef. */
+};
+
+static struct _Dwarf_AbbrevTable *abbrev_tables[ABBREV_TABLE_BUCKETS];
+static struct _Dwarf_AbbrevTable *abbrev_table_last;
+
+static void
+_dwarf_abbrev_table_free(struct _Dwarf_AbbrevTable *at)
+{
+    kfree(at->at_ents);
+    kfree(at->at_bycode);
+    kfree(at->at_hash);
+    kfree(at->at_attrdef);
+    kfree(at);
+}
+
+/* Return NULL if there is no memory for the table. */
+static struct _Dwarf_AbbrevTable *
+_dwarf_abbrev_table_load(Dwarf_Debug dbg, Dwarf_CU cu, Dwarf_Section *ds)
+{
+    struct _Dwarf_AbbrevTable *at;
+    struct _Dwarf_AbbrevEnt *ae;
+    Dwarf_AttrDef *ad;
+    Dwarf_Abbrev ab;
+    uint64_t offset, nents, ndefs, nsparse, i, h;
+
+    /*
+     * First pass: count entries and attribute defines.  A table that
+     * runs off the end of the section stops at the last whole entry.
+     */
+    nents = ndefs = 0;
+    offset = cu.debug_abbrev_offset;
+    while (offset < ds->ds_size &&
+        _dwarf_abbrev_parse(dbg, cu, &offset, &ab, ds) == DW_DLE_NONE &&
+        offset <= ds->ds_size && ab.ab_entry != 0) {
+        nents++;
+        ndefs += ab.ab_atnum;
+    }
+
+    if ((at = kmalloc(sizeof(*at), ALLOC_ZERO)) == NULL)
+        return (NULL);
+    at->at_offset = cu.debug_abbrev_offset;
+    at->at_nents = nents;
+    at->at_ncodes = 2 * nents + 1;
+    at->at_ents = kmalloc(nents * sizeof(at->at_ents[0]), 0);
+    at->at_bycode = kmalloc(at->at_ncodes * sizeof(at->at_bycode[0]),
+        ALLOC_ZERO);
+    at->at_attrdef = kmalloc(ndefs * sizeof(at->at_attrdef[0]), 0);
+    if ((nents && at->at_ents == NULL) || at->at_bycode == NULL ||
+        (ndefs && at->at_attrdef == NULL)) {
+        _dwarf_abbrev_table_free(at);
+        return (NULL);
+    }
+
+    /* Second pass: fill in the entries. */
+    offset = cu.debug_abbrev_offset;
+    ad = at->at_attrdef;
+    nsparse = 0;
+    for (i = 0; i < nents && offset < ds->ds_size; i++) {
+        if (_dwarf_abbrev_parse(dbg, cu, &offset, &ab, ds) != DW_DLE_NONE)
+            break;
+        ae = &at->at_ents[i];
+        ae->ae_entry = ab.ab_entry;
+        ae->ae_tag = ab.ab_tag;
+        ae->ae_offset = ab.ab_offset;
+        ae->ae_length = ab.ab_length;
+        ae->ae_atnum = ab.ab_atnum;
+        ae->ae_children = ab.ab_children;
+        ae->ae_attrdef = ad;
+        memcpy(ad, ab.ab_attrdef, ab.ab_atnum * sizeof(*ad));
+        ad += ab.ab_atnum;
+        if (ab.ab_entry >= at->at_ncodes)
+            nsparse++;
+        else if (at->at_bycode[ab.ab_entry] == NULL)
+            at->at_bycode[ab.ab_entry] = ae;
+    }
+    at->at_nents = i;
+
+    if (nsparse) {
+        for (at->at_hashsize = 1; at->at_hashsize < 2 * nsparse;
+            at->at_hashsize <<= 1)
+            ;
+        at->at_hash = kmalloc(at->at_hashsize * sizeof(at->at_hash[0]),
+            ALLOC_ZERO);
+        if (at->at_hash == NULL) {
+            _dwarf_abbrev_table_free(at);
+            return (NULL);
+        }
+        for (i = 0; i < at->at_nents; i++) {
+            ae = &at->at_ents[i];
+            if (ae->ae_entry < at->at_ncodes)
+                continue;
+            h = ae->ae_entry & (at->at_hashsize - 1);
+            while (at->at_hash[h] != NULL &&
+                at->at_hash[h]->ae_entry != ae->ae_entry)
+                h = (h + 1) & (at->at_hashsize - 1);
+            if (at->at_hash[h] == NULL)
+                at->at_hash[h] = ae;
+        }
+    }
+
+    return (at);
+}
+
+static struct _Dwarf_AbbrevTable *
+_dwarf_abbrev_table_get(Dwarf_Debug dbg, Dwarf_CU cu, Dwarf_Section *ds)
+{
+    struct _Dwarf_AbbrevTable *at;
+    uint64_t b;
+
+    if (abbrev_table_last != NULL &&
+        abbrev_table_last->at_offset == cu.debug_abbrev_offset)
+        return (abbrev_table_last);
+
+    b = cu.debug_abbrev_offset % ABBREV_TABLE_BUCKETS;
+    for (at = abbrev_tables[b]; at != NULL; at = at->at_next)
+        if (at->at_offset == cu.debug_abbrev_offset)
+            break;
+    if (at == NULL) {
+        if ((at = _dwarf_abbrev_table_load(dbg, cu, ds)) == NULL)
+            return (NULL);
+        at->at_next = abbrev_tables[b];
+        abbrev_tables[b] = at;
+    }
+    abbrev_table_last = at;
+    return (at);
+}
+
+static struct _Dwarf_AbbrevEnt *
+_dwarf_abbrev_table_find(struct _Dwarf_AbbrevTable *at, uint64_t entry)
+{
+    uint64_t h;
+
+    if (entry < at->at_ncodes)
+        return (at->at_bycode[entry]);
+    if (at->at_hashsize == 0)
+        return (NULL);
+    for (h = entry & (at->at_hashsize - 1); at->at_hash[h] != NULL;
+        h = (h + 1) & (at->at_hashsize - 1))
+        if (at->at_hash[h]->ae_entry == entry)
+            return (at->at_hash[h]);
+    return (NULL);
+}
+
 //Return 0 on success
 int
 _dwarf_abbrev_find(Dwarf_Debug dbg, Dwarf_CU cu, uint64_t entry, Dwarf_Abbrev *abp)
 {
+    struct _Dwarf_AbbrevTable *at;
+    struct _Dwarf_AbbrevEnt *ae;
     Dwarf_Section *ds;
     uint64_t offset;
     int ret;
@@ -482,28 +658,33 @@ _dwarf_abbrev_find(Dwarf_Debug dbg, Dwarf_CU cu, uint64_t entry, Dwarf_Abbrev *a
 		return (DW_DLE_NO_ENTRY);
     }
 
-    /* Load and search the abbrev table. */
     ds = _dwarf_find_section(".debug_abbrev");
     assert(ds != NULL);
 
-    //TODO: We are starting offset from 0, however libdwarf logic
-    //      is keeping a counter for current offset. Ok. let use
-    //      that. I relent, but this will be done in Phase 2. :)
-    //offset = 0; //cu->cu_abbrev_offset_cur;
-    offset = cu.debug_abbrev_offset; //cu->cu_abbrev_offset_cur;
+    if ((at = _dwarf_abbrev_table_get(dbg, cu, ds)) != NULL) {
+        if ((ae = _dwarf_abbrev_table_find(at, entry)) == NULL)
+            return (DW_DLE_NO_ENTRY);
+        abp->ab_entry = ae->ae_entry;
+        abp->ab_tag = ae->ae_tag;
+        abp->ab_children = ae->ae_children;
+        abp->ab_offset = ae->ae_offset;
+        abp->ab_length = ae->ae_length;
+        abp->ab_atnum = ae->ae_atnum;
+        memcpy(abp->ab_attrdef, ae->ae_attrdef,
+            ae->ae_atnum * sizeof(abp->ab_attrdef[0]));
+        return (DW_DLE_NONE);
+    }
+
+    /* No memory for the table: search the section. */
+    offset = cu.debug_abbrev_offset;
     while (offset < ds->ds_size) {
         ret = _dwarf_abbrev_parse(dbg, cu, &offset, abp, ds);
         if (ret != DW_DLE_NONE)
             return (ret);
-        if (abp->ab_entry == entry) {
-            //cu->cu_abbrev_offset_cur = offset;
+        if (abp->ab_entry == entry)
             return DW_DLE_NONE;
-        }
-        if (abp->ab_entry == 0) {
-            //cu->cu_abbrev_offset_cur = offset;
-            //cu->cu_abbrev_loaded = 1;
+        if (abp->ab_entry == 0)
             break;
-        }
     }
 
     return DW_DLE_NO_ENTRY;
@@ -0,0 +1,49 @@
+#!/usr/bin/perl
+#
+# Usage: nm -n kernel | perl mksymtab.pl > ksymtab.S
+#
+# Turns the sorted output of nm into an assembly file holding the
+# kernel's text symbols, for address-to-symbol lookup at run time
+# without the debug sections (see ksym_lookup in kern/kdebug.c).
+# With no input it writes an empty table, for the kernel's first link.
+#
+# The table is:
+#	ksym_count	number of symbols
+#	ksym_addrs	their addresses, in ascending order
+#	ksym_names	offset of each symbol's name in ksym_strs
+#	ksym_strs	the names, NUL-terminated
+
+my (@addrs, @names);
+
+while (<STDIN>) {
+	next unless /^([0-9a-f]+) [tTwW] (\S+)$/;
+	next if $2 =~ /^\.L/;
+	push @addrs, $1;
+	push @names, $2;
+}
+
+print "# Generated by kern/mksymtab.pl from the kernel's symbols.\n";
+print "\t.section .rodata\n";
+
+print "\t.p2align 3\n";
+print "\t.globl ksym_addrs\n";
+print "ksym_addrs:\n";
+print "\t.quad 0x$_\n" foreach @addrs;
+
+my $off = 0;
+print "\t.globl ksym_names\n";
+print "ksym_names:\n";
+foreach (@names) {
+	print "\t.long $off\n";
+	$off += length($_) + 1;
+}
+
+print "\t.globl ksym_count\n";
+print "ksym_count:\n";
+printf "\t.long %d\n", scalar(@addrs);
+
+print "\t.globl ksym_strs\n";
+print "ksym_strs:\n";
+print "\t.asciz \"$_\"\n" foreach @names;
+
+print "\t.section .note.GNU-stack,\"\",\@progbits\n";
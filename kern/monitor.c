@@ -6,15 +6,20 @@
 #include <inc/memlayout.h>
 #include <inc/assert.h>
 #include <inc/x86.h>
+#include <inc/kbdreg.h>
 
 #include <kern/console.h>
 #include <kern/monitor.h>
 #include <kern/dwarf.h>
 #include <kern/kdebug.h>
 #include <kern/dwarf_api.h>
+#include <kern/pmap.h>
+#include <kern/kmalloc.h>
 
 #define CMDBUF_SIZE	80	// enough for one VGA text line
+#define BACKTRACE_DEPTH	32
 
+extern const char *panicstr;	// kern/init.c
 
 struct Command {
 	const char *name;
@@ -26,6 +31,13 @@ struct Command {
 static struct Command commands[] = {
 	{ "help", "Display this list of commands", mon_help },
 	{ "kerninfo", "Display information about the kernel", mon_kerninfo },
+	{ "backtrace", "Display a backtrace of the kernel stack; 'backtrace -n' skips file:line", mon_backtrace },
+	{ "memstat", "Display physical page allocator statistics", mon_memstat },
+	{ "kmemstat", "Display kmalloc size class statistics", mon_kmemstat },
+	{ "tlbstat", "Display TLB flush statistics; 'tlbstat N' sets the full-flush threshold", mon_tlbstat },
+	{ "diskbench", "Time reading the debug sections off the disk", mon_diskbench },
+	{ "console", "Display console backends; 'console NAME on|off' switches one", mon_console },
+	{ "scrollback", "Page back through lines scrolled off the screen", mon_scrollback },
 };
 #define NCOMMANDS (sizeof(commands)/sizeof(commands[0]))
 
@@ -54,13 +66,151 @@ mon_kerninfo(int argc, char **argv, struct Trapframe *tf)
 	cprintf("  end    %08x (virt)  %08x (phys)\n", end, end - KERNBASE);
 	cprintf("Kernel executable memory footprint: %dKB\n",
 		ROUNDUP(end - entry, 1024) / 1024);
+	cprintf("Debug sections: %dKB of %dKB read on demand, in %ld cycles\n",
+		ROUNDUP(debug_sect_loaded, 1024) / 1024,
+		ROUNDUP(debug_sect_deferred, 1024) / 1024, debug_sect_load_tsc);
+	return 0;
+}
+
+int
+mon_memstat(int argc, char **argv, struct Trapframe *tf)
+{
+	page_print_stats();
+	return 0;
+}
+
+int
+mon_kmemstat(int argc, char **argv, struct Trapframe *tf)
+{
+	kmem_print_stats();
+	return 0;
+}
+
+int
+mon_tlbstat(int argc, char **argv, struct Trapframe *tf)
+{
+	long n;
+	char *end;
+
+	if (argc > 2) {
+		cprintf("usage: tlbstat [threshold]\n");
+		return 0;
+	}
+	if (argc == 2) {
+		n = strtol(argv[1], &end, 0);
+		if (*end || n < 0 || n > TLB_GATHER_MAX) {
+			cprintf("threshold must be between 0 and %d\n", TLB_GATHER_MAX);
+			return 0;
+		}
+		tlb_flush_threshold = n;
+	}
+	tlb_print_stats();
+	return 0;
+}
+
+int
+mon_console(int argc, char **argv, struct Trapframe *tf)
+{
+	bool on;
+
+	if (argc != 1 && argc != 3) {
+		cprintf("usage: console [backend on|off]\n");
+		return 0;
+	}
+	if (argc == 3) {
+		if (strcmp(argv[2], "on") == 0)
+			on = 1;
+		else if (strcmp(argv[2], "off") == 0)
+			on = 0;
+		else {
+			cprintf("usage: console [backend on|off]\n");
+			return 0;
+		}
+		if (cons_backend_enable(argv[1], on) < 0) {
+			cprintf("can't turn %s %s\n", argv[1], argv[2]);
+			return 0;
+		}
+	}
+	cons_print_stats();
+	return 0;
+}
+
+int
+mon_scrollback(int argc, char **argv, struct Trapframe *tf)
+{
+	int back, c;
+
+	cprintf("k/j or arrows: line up/down, b/space or PgUp/PgDn: page, q: quit\n");
+	back = cga_scrollback(CRT_ROWS - 1);
+	while ((c = getchar()) != 'q' && c != '\n' && c != '\r') {
+		switch (c) {
+		case 'k':
+		case KEY_UP:
+			back++;
+			break;
+		case 'j':
+		case KEY_DN:
+			back--;
+			break;
+		case 'b':
+		case KEY_PGUP:
+			back += CRT_ROWS - 1;
+			break;
+		case ' ':
+		case KEY_PGDN:
+			back -= CRT_ROWS - 1;
+			break;
+		}
+		back = cga_scrollback(back);
+	}
+	cga_scrollback(0);
+	return 0;
+}
+
+int
+mon_diskbench(int argc, char **argv, struct Trapframe *tf)
+{
+	debug_sect_bench();
 	return 0;
 }
 
 int
 mon_backtrace(int argc, char **argv, struct Trapframe *tf)
 {
-	// Your code here.
+	struct Unwindregs regs;
+	struct Ripdebuginfo info;
+	uintptr_t rips[BACKTRACE_DEPTH];
+	bool names_only;
+	int i, n;
+
+	names_only = argc == 2 && strcmp(argv[1], "-n") == 0;
+	if (argc > 1 && !names_only) {
+		cprintf("usage: backtrace [-n]\n");
+		return 0;
+	}
+
+	read_rip(regs.uw_rip);
+	regs.uw_rsp = read_rsp();
+	regs.uw_rbp = read_rbp();
+	n = unwind_stack(&regs, rips, BACKTRACE_DEPTH);
+
+	cprintf("Stack backtrace:\n");
+	for (i = 0; i < n; i++) {
+		cprintf("  rip %016lx\n", rips[i]);
+		// Describe the call, not the instruction after it.  -n
+		// stops at the symbol table, so it works without touching
+		// the disk for the debug sections.
+		if (names_only) {
+			if (debuginfo_rip_fn(i ? rips[i] - 1 : rips[i], &info) == 0)
+				cprintf("       %.*s+%016lx\n",
+					info.rip_fn_namelen, info.rip_fn_name,
+					rips[i] - info.rip_fn_addr);
+		} else if (debuginfo_rip(i ? rips[i] - 1 : rips[i], &info) == 0)
+			cprintf("       %s:%d: %.*s+%016lx  args:%d\n",
+				info.rip_file, info.rip_line,
+				info.rip_fn_namelen, info.rip_fn_name,
+				rips[i] - info.rip_fn_addr, info.rip_fn_narg);
+	}
 	return 0;
 }
 
@@ -120,6 +270,12 @@ monitor(struct Trapframe *tf)
 
 
 	while (1) {
+		// Between commands the kernel is idle: top up the pool of
+		// pre-zeroed pages for page_alloc(ALLOC_ZERO).  Not after a
+		// panic, which may have come from the free lists themselves,
+		// nor before page_init has set them up.
+		if (!panicstr && page_alloc_ready)
+			page_zero_idle(PAGE_ZERO_POOL);
 		buf = readline("K> ");
 		if (buf != NULL)
 			if (runcmd(buf, tf) < 0)
@@ -26,6 +26,7 @@
  #define MB_TYPE_ACPI_NVS 4
  #define MB_TYPE_BAD 5
 
+ #define MB_FLAG_CMDLINE 0x04
  #define MB_FLAG_MMAP 0x40
  
  /* The Multiboot header. */
@@ -99,7 +100,8 @@
    uint32_t type;
  } memory_map_t;
 
-uint32_t restrictive_type(uint32_t t1, uint32_t t2) {
+static inline uint32_t
+restrictive_type(uint32_t t1, uint32_t t2) {
   if(t1==MB_TYPE_BAD || t2==MB_TYPE_BAD)
     return MB_TYPE_BAD;
   else if(t1==MB_TYPE_ACPI_NVS || t2==MB_TYPE_ACPI_NVS)
@@ -0,0 +1,56 @@
+/* See COPYRIGHT for copyright information. */
+
+/* Just enough of the PCI bus to find a device and program it. */
+
+#include <inc/x86.h>
+#include <inc/assert.h>
+
+#include <kern/pci.h>
+
+static uint32_t
+pci_conf_addr(struct pci_func *f, uint32_t off)
+{
+	assert(f->bus < 256 && f->dev < 32 && f->func < 8);
+	assert(off < 256 && (off & 3) == 0);
+	return (1 << 31) | (f->bus << 16) | (f->dev << 11) | (f->func << 8) | off;
+}
+
+uint32_t
+pci_conf_read(struct pci_func *f, uint32_t off)
+{
+	outl(PCI_CONF_ADDR, pci_conf_addr(f, off));
+	return inl(PCI_CONF_DATA);
+}
+
+void
+pci_conf_write(struct pci_func *f, uint32_t off, uint32_t v)
+{
+	outl(PCI_CONF_ADDR, pci_conf_addr(f, off));
+	outl(PCI_CONF_DATA, v);
+}
+
+// Find the first function on bus 0 of the given class and subclass.
+// Fills in *f and returns 1 if there is one, returns 0 if not.
+int
+pci_find_class(uint32_t class, uint32_t subclass, struct pci_func *f)
+{
+	uint32_t nfunc;
+
+	f->bus = 0;
+	for (f->dev = 0; f->dev < 32; f->dev++) {
+		nfunc = 1;
+		for (f->func = 0; f->func < nfunc; f->func++) {
+			f->dev_id = pci_conf_read(f, PCI_ID_REG);
+			if (PCI_VENDOR(f->dev_id) == 0xffff)
+				continue;
+			if (f->func == 0
+			    && PCI_HDRTYPE_MULTIFN(pci_conf_read(f, PCI_BHLC_REG)))
+				nfunc = 8;
+			f->dev_class = pci_conf_read(f, PCI_CLASS_REG);
+			if (PCI_CLASS(f->dev_class) == class
+			    && PCI_SUBCLASS(f->dev_class) == subclass)
+				return 1;
+		}
+	}
+	return 0;
+}
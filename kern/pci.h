@@ -0,0 +1,49 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_PCI_H
+#define JOS_KERN_PCI_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+// Configuration mechanism #1 ports
+#define PCI_CONF_ADDR	0xCF8
+#define PCI_CONF_DATA	0xCFC
+
+// Configuration space registers
+#define PCI_ID_REG		0x00
+#define PCI_COMMAND_STATUS_REG	0x04
+#define PCI_CLASS_REG		0x08
+#define PCI_BHLC_REG		0x0C
+#define PCI_MAPREG_START	0x10	// BAR0; BARn is at 0x10 + 4*n
+
+#define PCI_COMMAND_IO_ENABLE		0x00000001
+#define PCI_COMMAND_MEM_ENABLE		0x00000002
+#define PCI_COMMAND_MASTER_ENABLE	0x00000004
+
+#define PCI_VENDOR(id)		((id) & 0xffff)
+#define PCI_CLASS(cl)		(((cl) >> 24) & 0xff)
+#define PCI_SUBCLASS(cl)	(((cl) >> 16) & 0xff)
+#define PCI_INTERFACE(cl)	(((cl) >> 8) & 0xff)
+#define PCI_HDRTYPE_MULTIFN(bhlc)	((bhlc) & 0x00800000)
+
+#define PCI_CLASS_MASS_STORAGE		0x01
+#define PCI_SUBCLASS_MASS_STORAGE_IDE	0x01
+
+// One function of a device on the PCI bus
+struct pci_func {
+	uint32_t bus;
+	uint32_t dev;
+	uint32_t func;
+
+	uint32_t dev_id;
+	uint32_t dev_class;
+};
+
+uint32_t pci_conf_read(struct pci_func *f, uint32_t off);
+void	 pci_conf_write(struct pci_func *f, uint32_t off, uint32_t v);
+int	 pci_find_class(uint32_t class, uint32_t subclass, struct pci_func *f);
+
+#endif /* !JOS_KERN_PCI_H */
@@ -8,6 +8,7 @@
 
 #include <kern/pmap.h>
 #include <kern/kclock.h>
+#include <kern/cpu.h>
 #include <kern/multiboot.h>
 
 extern uint64_t pml4phys;
@@ -15,14 +16,28 @@ extern uint64_t pml4phys;
 #define BOOT_PAGE_TABLE_END   ((uint64_t) KADDR((uint64_t) (&pml4phys) + 5*PGSIZE))
 
 // These variables are set by i386_detect_memory()
-size_t npages;			// Amount of physical memory (in pages)
+size_t npages;			// Number of entries in 'pages'
+physaddr_t maxpa;		// One past the highest usable physical address
 static size_t npages_basemem;	// Amount of base memory (in pages)
+static physaddr_t boot_alloc_limit;	// boot_alloc must stay below this
+int16_t section_index[NSECTIONS];	// physical section -> slot in 'pages'
+ppn_t section_ppn[NSECTIONS];		// slot in 'pages' -> first ppn
+
+// Usable physical memory, sorted and with adjacent ranges merged.
+#define NMEMRANGE	32
+static struct MemRange {
+	physaddr_t mr_start;
+	physaddr_t mr_end;
+} mem_ranges[NMEMRANGE];
+static int nmem_ranges;
 
 // These variables are set in x86_vm_init()
 pml4e_t *boot_pml4e;		// Kernel's initial page directory
 physaddr_t boot_cr3;		// Physical address of boot time page directory
 struct PageInfo *pages;		// Physical page state array
-static struct PageInfo *page_free_list;	// Free list of physical pages
+bool page_alloc_ready;		// page_init has filled the free lists
+static struct PageInfo *page_free_list[PAGE_MAX_ORDER + 1];	// Free blocks, by order
+static bool page1gb;		// CPU supports 1GB pages (CPUID pdpe1gb)
 
 // --------------------------------------------------------------
 // Detect machine's physical memory setup.
@@ -34,6 +49,39 @@ nvram_read(int r)
 	return mc146818_read(r) | (mc146818_read(r + 1) << 8);
 }
 
+//
+// Record [start, end) as usable memory, trimmed to whole pages.  Ranges
+// must be added in ascending order.
+//
+static void
+mem_range_add(physaddr_t start, physaddr_t end)
+{
+	physaddr_t limit = (physaddr_t) NSECTIONS << (SECTION_SHIFT + PGSHIFT);
+	struct MemRange *last = nmem_ranges ? &mem_ranges[nmem_ranges - 1] : NULL;
+
+	start = ROUNDUP(start, PGSIZE);
+	end = ROUNDDOWN(end, PGSIZE);
+	if (start >= end)
+		return;
+	if (end > limit) {
+		cprintf("Ignoring memory above %uG\n", limit >> 30);
+		end = limit;
+		if (start >= end)
+			return;
+	}
+	if (last && last->mr_end >= start) {
+		last->mr_end = MAX(last->mr_end, end);
+		return;
+	}
+	if (nmem_ranges == NMEMRANGE) {
+		cprintf("Too many memory ranges, ignoring [%lx, %lx)\n", start, end);
+		return;
+	}
+	mem_ranges[nmem_ranges].mr_start = start;
+	mem_ranges[nmem_ranges].mr_end = end;
+	nmem_ranges++;
+}
+
 static void
 multiboot_read(multiboot_info_t* mbinfo, size_t* basemem, size_t* extmem) {
 	int i;
@@ -60,7 +108,7 @@ multiboot_read(multiboot_info_t* mbinfo, size_t* basemem, size_t* extmem) {
         	memory_map_t* this = mmap_list[j];
         	uint64_t this_addr = APPEND_HILO(this->base_addr_high, this->base_addr_low);
         	if(this_addr > addr) {
-        		int last = i+1;
+        		int last = i;
         		while(last != j) {
         			*(mmap_list + last) = *(mmap_list + last - 1);
         			last--;
@@ -101,10 +149,14 @@ multiboot_read(multiboot_info_t* mbinfo, size_t* basemem, size_t* extmem) {
 		memory_map_t* mmap = mmap_list[i];
 		if(mmap) {
 			if(mmap->type == MB_TYPE_USABLE || mmap->type == MB_TYPE_ACPI_RECLM) {
+				uint64_t addr = APPEND_HILO(mmap->base_addr_high, mmap->base_addr_low);
+				uint64_t len = APPEND_HILO(mmap->length_high, mmap->length_low);
+
 				if(mmap->base_addr_low < 0x100000 && mmap->base_addr_high == 0)
-					*basemem += APPEND_HILO(mmap->length_high, mmap->length_low);
+					*basemem += len;
 				else
-					*extmem += APPEND_HILO(mmap->length_high, mmap->length_low);
+					*extmem += len;
+				mem_range_add(addr, addr + len);
 			}
 		}
 	}
@@ -113,9 +165,11 @@ multiboot_read(multiboot_info_t* mbinfo, size_t* basemem, size_t* extmem) {
 static void
 i386_detect_memory(void)
 {
-	size_t npages_extmem;
 	size_t basemem = 0;
 	size_t extmem = 0;
+	size_t nsections = 0;
+	int i;
+	ppn_t sec, last;
 
 	// Check if the bootloader passed us a multiboot structure
 	extern char multiboot_info[];
@@ -127,44 +181,47 @@ i386_detect_memory(void)
 	} else {
 		basemem = (nvram_read(NVRAM_BASELO) * 1024);
 		extmem = (nvram_read(NVRAM_EXTLO) * 1024);
+		if(nvram_read(NVRAM_EXTLO) == 0xffff) {
+			// EXTMEM > 16M in blocks of 64k
+			size_t pextmem = nvram_read(NVRAM_EXTGT16LO) * (64 * 1024);
+			extmem = (16 * 1024 * 1024) + pextmem - (1 * 1024 * 1024);
+		}
+		mem_range_add(0, basemem);
+		mem_range_add(EXTPHYSMEM, EXTPHYSMEM + extmem);
 	}
     
 	assert(basemem);
+	assert(nmem_ranges > 0);
 
 	npages_basemem = basemem / PGSIZE;
-	npages_extmem = extmem / PGSIZE;
-	
-	// Calculate the number of physical pages available in both base
-	// and extended memory.
-	if (npages_extmem)
-		npages = (EXTPHYSMEM / PGSIZE) + npages_extmem;
-	else
-		npages = npages_basemem;
-
-	if(nvram_read(NVRAM_EXTLO) == 0xffff) {
-		// EXTMEM > 16M in blocks of 64k
-		size_t pextmem = nvram_read(NVRAM_EXTGT16LO) * (64 * 1024);
-		npages_extmem = ((16 * 1024 * 1024) + pextmem - (1 * 1024 * 1024)) / PGSIZE;
-	}
-	
-	// Calculate the number of physical pages available in both base
-	// and extended memory.
-	if (npages_extmem)
-		npages = (EXTPHYSMEM / PGSIZE) + npages_extmem;
-	else
-		npages = npages_basemem;
-
-	cprintf("Physical memory: %uM available, base = %uK, extended = %uK, npages = %d\n",
-		npages * PGSIZE / (1024 * 1024),
-		npages_basemem * PGSIZE / 1024,
-		npages_extmem * PGSIZE / 1024,
-		npages);
-	
-	//JOS is hardwired to support only 256M of physical memory
-	if(npages > ((255 * 1024 * 1024)/PGSIZE)) {
-		npages = (255 * 1024 * 1024) / PGSIZE;
-		cprintf("Using only %uK of the available memory.\n", npages * PGSIZE/1024);
+	maxpa = mem_ranges[nmem_ranges - 1].mr_end;
+
+	// Give every section that holds usable memory a slot in 'pages'.
+	memset(section_index, 0xFF, sizeof(section_index));
+	for (i = 0; i < nmem_ranges; i++) {
+		last = (mem_ranges[i].mr_end - 1) >> (SECTION_SHIFT + PGSHIFT);
+		for (sec = mem_ranges[i].mr_start >> (SECTION_SHIFT + PGSHIFT); sec <= last; sec++) {
+			if (section_index[sec] >= 0)
+				continue;
+			section_index[sec] = nsections;
+			section_ppn[nsections] = sec << SECTION_SHIFT;
+			nsections++;
+		}
 	}
+	npages = nsections * SECTION_PAGES;
+
+	// The boot-time allocations ('pages' among them) follow the kernel
+	// in the range that holds it, and must stay inside the part of
+	// memory bootstrap.S mapped.
+	boot_alloc_limit = 0;
+	for (i = 0; i < nmem_ranges; i++)
+		if (mem_ranges[i].mr_start <= EXTPHYSMEM && EXTPHYSMEM < mem_ranges[i].mr_end)
+			boot_alloc_limit = MIN(mem_ranges[i].mr_end, (physaddr_t) BOOTMAPSIZE);
+
+	cprintf("Physical memory: %uM available, base = %uK, extended = %uK\n",
+		(basemem + extmem) / (1024 * 1024), basemem / 1024, extmem / 1024);
+	cprintf("%d usable ranges up to %lx, %d sections, npages = %d\n",
+		nmem_ranges, maxpa, nsections, npages);
 }
 
 
@@ -173,12 +230,25 @@ i386_detect_memory(void)
 // --------------------------------------------------------------
 
 static void boot_map_region(pml4e_t *pml4e, uintptr_t va, size_t size, physaddr_t pa, int perm);
+static void pcid_init(void);
 static void check_page_free_list(bool only_low_memory);
 static void check_page_alloc(void);
+static void check_page_alloc_order(void);
+static void check_page_cache(void);
+static void check_page_zero(void);
+static void check_pt_cursor(void);
+static void check_free_low_tables(void);
+static void check_tlb_gather(void);
+static void check_pcid(void);
 static void check_boot_pml4e(pml4e_t *pml4e);
 static physaddr_t check_va2pa(pde_t *pgdir, uintptr_t va);
+static size_t check_va2pgsize(pml4e_t *pml4e, uintptr_t va);
+static pte_t check_va2leaf(pml4e_t *pml4e, uintptr_t va);
+static void check_not_global(uint64_t *table, int level, uintptr_t va);
+static void check_direct_map(pml4e_t *pml4e, physaddr_t start, physaddr_t end);
 static void page_check(void);
 static void page_initpp(struct PageInfo *pp);
+static void page_init_range(physaddr_t lo, physaddr_t hi);
 // This simple physical memory allocator is used only while JOS is setting
 // up its virtual memory system.  page_alloc() is the real allocator.
 //
@@ -210,10 +280,22 @@ boot_alloc(uint32_t n)
 	// Allocate a chunk large enough to hold 'n' bytes, then update
 	// nextfree.  Make sure nextfree is kept aligned
 	// to a multiple of PGSIZE.
-	//
-	// LAB 2: Your code here.
+	result = nextfree;
+	if (n > 0) {
+		nextfree = ROUNDUP(nextfree + n, PGSIZE);
+		if (PADDR(nextfree) > boot_alloc_limit)
+			panic("boot_alloc: out of memory");
+	}
+	return result;
+}
 
-	return NULL;
+// How much of 'pages' is mapped at UPAGES: all of it, or as much as
+// fits below ULIM.
+static size_t
+upages_size(void)
+{
+	return MIN(ROUNDUP(npages * sizeof(struct PageInfo), PGSIZE),
+		   (size_t) (ULIM - UPAGES));
 }
 
 // Set up a four-level page table:
@@ -230,14 +312,21 @@ x64_vm_init(void)
 {
 	pml4e_t* pml4e;
 	uint32_t cr0;
+	uint32_t eax, edx;
 	uint64_t n;
-	int r;
+	int i, r;
 	struct Env *env;
 	i386_detect_memory();
-	//panic("i386_vm_init: This function is not finished\n");
+
+	// 1GB pages are optional; everything 64-bit has 2MB pages.
+	cpuid(CPUID_EXT_MAX, &eax, NULL, NULL, NULL);
+	if (eax >= CPUID_EXT_FEATURES) {
+		cpuid(CPUID_EXT_FEATURES, NULL, NULL, NULL, &edx);
+		page1gb = (edx & CPUID_EXT_PDPE1GB) != 0;
+	}
+
 	//////////////////////////////////////////////////////////////////////
 	// create initial page directory.
-	panic("x64_vm_init: this function is not finished\n");
 	pml4e = boot_alloc(PGSIZE);
 	memset(pml4e, 0, PGSIZE);
 	boot_pml4e = pml4e;
@@ -246,9 +335,10 @@ x64_vm_init(void)
 	//////////////////////////////////////////////////////////////////////
 	// Allocate an array of npages 'struct PageInfo's and store it in 'pages'.
 	// The kernel uses this array to keep track of physical pages: for
-	// each physical page, there is a corresponding struct PageInfo in this
-	// array.  'npages' is the number of physical pages in memory.
-	// Your code goes here:
+	// each physical page in a present section, there is a corresponding
+	// struct PageInfo in this array.
+	pages = boot_alloc(npages * sizeof(struct PageInfo));
+	memset(pages, 0, npages * sizeof(struct PageInfo));
 
 	//////////////////////////////////////////////////////////////////////
 	// Now that we've allocated the initial kernel data structures, we set
@@ -265,8 +355,9 @@ x64_vm_init(void)
 	//    - the new image at UPAGES -- kernel R, us/er R
 	//      (ie. perm = PTE_U | PTE_P)
 	//    - pages itself -- kernel RW, user NONE
-	// Your code goes here:
-
+	//    - with more memory than that window holds, only the head of
+	//      'pages' is visible to the user
+	boot_map_region(pml4e, UPAGES, upages_size(), PADDR(pages), PTE_U);
 
 	//////////////////////////////////////////////////////////////////////
 	// Use the physical memory that 'bootstack' refers to as the kernel
@@ -277,28 +368,49 @@ x64_vm_init(void)
 	//     * [KSTACKTOP-PTSIZE, KSTACKTOP-KSTKSIZE) -- not backed; so if
 	//       the kernel overflows its stack, it will fault rather than
 	//       overwrite memory.  Known as a "guard page".
-	//     Permissions: kernel RW, user NONE
-	// Your code goes here:
+	//     Permissions: kernel RW, user NONE, global
+	boot_map_region(pml4e, KSTACKTOP - KSTKSIZE, KSTKSIZE, PADDR(bootstack), PTE_W | PTE_G);
 
 	//////////////////////////////////////////////////////////////////////
-	// Map all of physical memory at KERNBASE. We have detected the number
-    // of physical pages to be npages.
-	// Ie.  the VA range [KERNBASE, npages*PGSIZE) should map to
-	//      the PA range [0, npages*PGSIZE)
-	// Permissions: kernel RW, user NONE
-	// Your code goes here: 
+	// Map all of physical memory at KERNBASE: the first megabyte (BIOS
+	// and device memory included) and every usable range.
+	// Ie.  the VA range [KERNBASE+pa, KERNBASE+pa+len) should map to
+	//      the PA range [pa, pa+len)
+	// Permissions: kernel RW, user NONE, global
+	// boot_map_region uses large pages wherever the range allows.
+	// Everything above ULIM is the same in every address space, so it
+	// is mapped global and its TLB entries outlive CR3 switches.
+	boot_map_region(pml4e, KERNBASE, EXTPHYSMEM, 0, PTE_W | PTE_G);
+	for (i = 0; i < nmem_ranges; i++) {
+		physaddr_t start = MAX(mem_ranges[i].mr_start, (physaddr_t) EXTPHYSMEM);
+
+		if (start < mem_ranges[i].mr_end)
+			boot_map_region(pml4e, KERNBASE + start,
+					mem_ranges[i].mr_end - start, start, PTE_W | PTE_G);
+	}
+
 	// Check that the initial page directory has been set up correctly.
 	check_boot_pml4e(boot_pml4e);
 
 	//////////////////////////////////////////////////////////////////////
-	// Permissions: kernel RW, user NONE
-	pdpe_t *pdpe = KADDR(PTE_ADDR(pml4e[1]));
-	pde_t *pgdir = KADDR(PTE_ADDR(pdpe[0]));
+	// Switch from the boot page table to the one we just built, which
+	// maps all memory, and free what bootstrap.S did not map.  Turning
+	// on CR4.PGE makes PTE_G count (and flushes the whole TLB); from
+	// here on address spaces can carry PCIDs.
 	lcr3(boot_cr3);
+	lcr4(rcr4() | CR4_PGE);
+	pcid_init();
+	page_init_range(BOOTMAPSIZE, maxpa);
 
 	check_page_free_list(1);
 	check_page_alloc();
+	check_page_alloc_order();
+	check_page_cache();
+	check_page_zero();
 	page_check();
+	check_pt_cursor();
+	check_tlb_gather();
+	check_pcid();
 	check_page_free_list(0);
 }
 
@@ -306,9 +418,72 @@ x64_vm_init(void)
 // --------------------------------------------------------------
 // Tracking of physical pages.
 // The 'pages' array has one 'struct PageInfo' entry per physical page.
-// Pages are reference counted, and free pages are kept on a linked list.
+// Pages are reference counted, and free pages are kept in a binary
+// buddy allocator: page_free_list[k] links the first page of every free
+// block of 2^k contiguous pages.  The buddy of a block is found by
+// flipping bit k of its page number, so splitting and coalescing are
+// both O(PAGE_MAX_ORDER).
 // --------------------------------------------------------------
 
+static void
+free_list_push(struct PageInfo *pp, int order)
+{
+	pp->pp_order = order;
+	pp->pp_flags |= PP_FREE;
+	pp->pp_link = page_free_list[order];
+	if (pp->pp_link)
+		pp->pp_link->pp_pprev = &pp->pp_link;
+	pp->pp_pprev = &page_free_list[order];
+	page_free_list[order] = pp;
+}
+
+static void
+free_list_remove(struct PageInfo *pp)
+{
+	*pp->pp_pprev = pp->pp_link;
+	if (pp->pp_link)
+		pp->pp_link->pp_pprev = pp->pp_pprev;
+	pp->pp_link = NULL;
+	pp->pp_pprev = NULL;
+	pp->pp_flags &= ~PP_FREE;
+}
+
+//
+// Hand the usable pages in [lo, hi) to the buddy allocator, skipping
+// the ones page_init describes as in use.
+//
+// Free pages are handed to page_free_order one at a time in address
+// order, which lets each page coalesce with the block below it; the
+// result is the same set of maximal aligned blocks a bulk build
+// would produce.
+// NB: DO NOT actually touch the physical memory corresponding to
+// free pages!
+//
+static void
+page_init_range(physaddr_t lo, physaddr_t hi)
+{
+	physaddr_t first_free = PADDR(boot_alloc(0));
+	physaddr_t pa;
+	int i;
+
+	for (i = 0; i < nmem_ranges; i++) {
+		for (pa = MAX(lo, mem_ranges[i].mr_start);
+		     pa < MIN(hi, mem_ranges[i].mr_end); pa += PGSIZE) {
+			uint64_t va = (uint64_t) KERNBASE + pa;
+
+			if (pa == 0)
+				continue;
+			if (pa == 0x10000)
+				continue;
+			if (pa >= EXTPHYSMEM && pa < first_free)
+				continue;
+			if (va >= BOOT_PAGE_TABLE_START && va < BOOT_PAGE_TABLE_END)
+				continue;
+			page_free_order(pa2page(pa), 0);
+		}
+	}
+}
+
 //
 // Initialize page structure and memory free list.
 // After this is done, NEVER use boot_alloc again.  ONLY use the page
@@ -318,37 +493,255 @@ x64_vm_init(void)
 	void
 page_init(void)
 {
-	// The example code here marks all physical pages as free.
-	// However this is not truly the case.  What memory is free?
-	//  1) Mark physical page 0 as in use.
+	// What memory is free?
+	//  1) Physical page 0 is in use.
 	//     This way we preserve the real-mode IDT and BIOS structures
 	//     in case we ever need them.  (Currently we don't, but...)
-	//  2) The rest of base memory, [PGSIZE, npages_basemem * PGSIZE)
-	//     is free.
+	//  2) The rest of base memory is free, except for the kernel ELF
+	//     header the boot loader left at 0x10000, which kdebug still
+	//     reads.
 	//  3) Then comes the IO hole [IOPHYSMEM, EXTPHYSMEM), which must
 	//     never be allocated.
-	//  4) Then extended memory [EXTPHYSMEM, ...).
-	//     Some of it is in use, some is free. Where is the kernel
-	//     in physical memory?  Which pages are already in use for
-	//     page tables and other data structures?
+	//  4) Then extended memory [EXTPHYSMEM, ...).  Everything up to
+	//     boot_alloc(0) holds the kernel, the boot page table, the
+	//     debug sections and the structures allocated so far.
+	//  5) Beyond that, every range the memory map reports as usable,
+	//     wherever it is.  PageInfos for the holes between them stay
+	//     allocated forever.
 	//
-	// Change the code to reflect this.
-	// NB: DO NOT actually touch the physical memory corresponding to
-	// free pages!
-    // NB: Make sure you preserve the direction in which your page_free_list 
-    // is constructed
-	// NB: Remember to mark the memory used for initial boot page table i.e (va>=BOOT_PAGE_TABLE_START && va < BOOT_PAGE_TABLE_END) as in-use (not free)
+	// Only memory bootstrap.S mapped is freed here, since the page
+	// tables x64_vm_init builds next come from the free lists; it
+	// frees the rest once it has switched to its own page table.
 	size_t i;
-	struct PageInfo* last = NULL;
-	for (i = 0; i < npages; i++) {
-		pages[i].pp_ref = 0;
-		pages[i].pp_link = NULL;
-        if(last)
-            last->pp_link = &pages[i];
-        else
-            page_free_list = &pages[i];
-		last = &pages[i];
+
+	memset(page_free_list, 0, sizeof(page_free_list));
+	for (i = 0; i < npages; i++)
+		page_initpp(&pages[i]);
+	page_init_range(0, BOOTMAPSIZE);
+	page_alloc_ready = 1;
+}
+
+//
+// Allocates a block of 2^order physically contiguous pages, aligned to
+// its size.  If (alloc_flags & ALLOC_ZERO), fills the whole block with
+// '\0' bytes.  Does NOT increment the reference count of the page - the
+// caller must do these if necessary (either explicitly or via
+// page_insert).
+//
+// The smallest free block of at least 'order' is taken and split in
+// halves, returning the upper half of each split to the free lists.
+//
+// Returns NULL if no block that large is free.
+//
+struct PageInfo *
+page_alloc_order(int order, int alloc_flags)
+{
+	struct PageInfo *pp;
+	int o;
+
+	if (order < 0 || order > PAGE_MAX_ORDER)
+		return NULL;
+
+	for (o = order; o <= PAGE_MAX_ORDER; o++)
+		if (page_free_list[o])
+			break;
+	if (o > PAGE_MAX_ORDER)
+		return NULL;
+
+	pp = page_free_list[o];
+	free_list_remove(pp);
+	while (o > order) {
+		o--;
+		free_list_push(pp + (1 << o), o);
+	}
+	pp->pp_order = order;
+
+	if (alloc_flags & ALLOC_ZERO)
+		memset(page2kva(pp), 0, PGSIZE << order);
+	return pp;
+}
+
+//
+// Return a block of 2^order pages, as returned by page_alloc_order, to
+// the free lists, merging it with its buddy for as long as the buddy is
+// also free and whole.
+//
+void
+page_free_order(struct PageInfo *pp, int order)
+{
+	// Sections are far larger than the largest block and start on
+	// section boundaries in 'pages', so buddies can be found by index
+	// in 'pages' just as by physical page number.
+	size_t idx = pp - pages;
+
+	if (pp->pp_ref != 0 || pp->pp_link != NULL || (pp->pp_flags & (PP_FREE | PP_CACHED | PP_ZEROED)))
+		panic("page_free_order: freeing busy page %08lx", page2pa(pp));
+	assert(order >= 0 && order <= PAGE_MAX_ORDER);
+	assert((idx & ((1 << order) - 1)) == 0);
+
+	while (order < PAGE_MAX_ORDER) {
+		size_t buddy = idx ^ (1 << order);
+		struct PageInfo *bp = &pages[buddy];
+
+		if (buddy + (1 << order) > npages)
+			break;
+		if (!(bp->pp_flags & PP_FREE) || bp->pp_order != order)
+			break;
+		free_list_remove(bp);
+		bp->pp_order = 0;
+		idx &= ~(size_t) (1 << order);
+		order++;
+	}
+	free_list_push(&pages[idx], order);
+}
+
+// --------------------------------------------------------------
+// Per-CPU page caches.
+// Single-page allocations and frees go through a small stack of free
+// pages owned by the current CPU, so the common path touches no shared
+// state.  Only when the stack runs empty (or full) does the CPU go to
+// the buddy lists, and then it moves PAGE_CACHE_BATCH pages at once.
+// Cached pages are allocated as far as the buddy lists are concerned.
+// --------------------------------------------------------------
+
+struct PageCache {
+	struct PageInfo *pc_pages[PAGE_CACHE_HIGH];	// top is the hottest
+	int pc_count;
+	uint64_t pc_hits;	// page_allocs served without a refill
+	uint64_t pc_refills;	// batches taken from the buddy lists
+	uint64_t pc_drains;	// batches given back to the buddy lists
+};
+
+static struct PageCache page_caches[NCPU];
+
+static void
+page_cache_refill(struct PageCache *pc)
+{
+	struct PageInfo *pp;
+	int i;
+
+	for (i = 0; i < PAGE_CACHE_BATCH; i++) {
+		if (!(pp = page_alloc_order(0, 0)))
+			break;
+		pp->pp_flags |= PP_CACHED;
+		pc->pc_pages[pc->pc_count++] = pp;
+	}
+	pc->pc_refills++;
+}
+
+// Give the n coldest pages (the bottom of the stack) back to the
+// buddy lists, where they can coalesce again.
+static void
+page_cache_drain(struct PageCache *pc, int n)
+{
+	int i;
+
+	n = MIN(n, pc->pc_count);
+	for (i = 0; i < n; i++) {
+		pc->pc_pages[i]->pp_flags &= ~PP_CACHED;
+		page_free_order(pc->pc_pages[i], 0);
+	}
+	memmove(pc->pc_pages, pc->pc_pages + n,
+		(pc->pc_count - n) * sizeof(pc->pc_pages[0]));
+	pc->pc_count -= n;
+	pc->pc_drains++;
+}
+
+//
+// Empty every CPU's page cache back into the buddy lists, e.g. before
+// a large contiguous allocation or to check the free lists.  The other
+// CPUs must not be allocating while this runs.
+//
+void
+page_cache_drain_all(void)
+{
+	int i;
+
+	for (i = 0; i < NCPU; i++)
+		if (page_caches[i].pc_count)
+			page_cache_drain(&page_caches[i], page_caches[i].pc_count);
+}
+
+// --------------------------------------------------------------
+// Pre-zeroed pages.
+// Zeroing a page costs a full 4KB of stores, and every new page-table
+// level wants a zeroed page.  Between monitor commands the kernel
+// calls page_zero_idle, which takes free pages from the buddy lists,
+// clears them with non-temporal stores (so the zeroes do not evict
+// anything useful from the cache) and parks them on page_zero_list.
+// page_alloc(ALLOC_ZERO) takes from that list first.
+// --------------------------------------------------------------
+
+static struct PageInfo *page_zero_list;
+static int page_zero_count;
+static uint64_t page_zero_hits;		// ALLOC_ZERO served from the pool
+static uint64_t page_zero_misses;	// ALLOC_ZERO that had to memset
+static uint64_t page_zero_filled;	// pages zeroed by page_zero_idle
+
+static void
+page_zero_nt(void *va)
+{
+	uint64_t *p = va, *end = p + PGSIZE / sizeof(uint64_t);
+
+	for (; p < end; p += 4)
+		__asm __volatile("movnti %1, (%0)\n\t"
+				 "movnti %1, 8(%0)\n\t"
+				 "movnti %1, 16(%0)\n\t"
+				 "movnti %1, 24(%0)"
+				 : : "r" (p), "r" ((uint64_t) 0) : "memory");
+	// make the stores globally visible before anyone uses the page
+	__asm __volatile("sfence" : : : "memory");
+}
+
+static struct PageInfo *
+page_zero_pop(void)
+{
+	struct PageInfo *pp;
+
+	if (!(pp = page_zero_list))
+		return NULL;
+	page_zero_list = pp->pp_link;
+	page_zero_count--;
+	pp->pp_link = NULL;
+	pp->pp_flags &= ~PP_ZEROED;
+	return pp;
+}
+
+//
+// Zero up to 'budget' free pages into the pre-zeroed pool, stopping when
+// the pool holds PAGE_ZERO_POOL pages or memory runs out.  Meant to be
+// called from idle loops.  Returns the number of pages zeroed.
+//
+int
+page_zero_idle(int budget)
+{
+	struct PageInfo *pp;
+	int n = 0;
+
+	while (n < budget && page_zero_count < PAGE_ZERO_POOL) {
+		if (!(pp = page_alloc_order(0, 0)))
+			break;
+		page_zero_nt(page2kva(pp));
+		pp->pp_flags |= PP_ZEROED;
+		pp->pp_link = page_zero_list;
+		page_zero_list = pp;
+		page_zero_count++;
+		page_zero_filled++;
+		n++;
 	}
+	return n;
+}
+
+//
+// Give every page in the pre-zeroed pool back to the buddy lists.
+//
+void
+page_zero_drain(void)
+{
+	struct PageInfo *pp;
+
+	while ((pp = page_zero_pop()))
+		page_free_order(pp, 0);
 }
 
 //
@@ -357,17 +750,37 @@ page_init(void)
 // count of the page - the caller must do these if necessary (either explicitly
 // or via page_insert).
 //
-// Be sure to set the pp_link field of the allocated page to NULL so
-// page_free can check for double-free bugs.
+// ALLOC_ZERO requests are served from the pre-zeroed pool when it has
+// pages, and zeroed synchronously otherwise.  When everything else is
+// exhausted, plain requests may also take pre-zeroed pages.
 //
 // Returns NULL if out of free memory.
 //
-// Hint: use page2kva and memset
 struct PageInfo *
 page_alloc(int alloc_flags)
 {
-	// Fill this function in
-	return 0;
+	struct PageCache *pc = &page_caches[cpunum()];
+	struct PageInfo *pp;
+
+	if ((alloc_flags & ALLOC_ZERO) && (pp = page_zero_pop())) {
+		page_zero_hits++;
+		return pp;
+	}
+
+	if (pc->pc_count == 0) {
+		page_cache_refill(pc);
+		if (pc->pc_count == 0)
+			return page_zero_pop();
+	} else
+		pc->pc_hits++;
+
+	pp = pc->pc_pages[--pc->pc_count];
+	pp->pp_flags &= ~PP_CACHED;
+	if (alloc_flags & ALLOC_ZERO) {
+		page_zero_misses++;
+		memset(page2kva(pp), 0, PGSIZE);
+	}
+	return pp;
 }
 
 //
@@ -387,9 +800,49 @@ page_initpp(struct PageInfo *pp)
 void
 page_free(struct PageInfo *pp)
 {
-	// Fill this function in
-	// Hint: You may want to panic if pp->pp_ref is nonzero or
-	// pp->pp_link is not NULL.
+	struct PageCache *pc = &page_caches[cpunum()];
+
+	if (pp->pp_ref != 0 || pp->pp_link != NULL || (pp->pp_flags & (PP_FREE | PP_CACHED | PP_ZEROED)))
+		panic("page_free: freeing busy page %08lx", page2pa(pp));
+
+	if (pc->pc_count == PAGE_CACHE_HIGH)
+		page_cache_drain(pc, PAGE_CACHE_BATCH);
+	pp->pp_flags |= PP_CACHED;
+	pc->pc_pages[pc->pc_count++] = pp;
+}
+
+//
+// Print the number of free blocks of each order, the per-CPU page
+// cache counters and the pre-zeroed pool counters.
+//
+void
+page_print_stats(void)
+{
+	struct PageInfo *pp;
+	size_t nblocks, nfree = 0;
+	int i;
+
+	cprintf("order  free blocks\n");
+	for (i = 0; i <= PAGE_MAX_ORDER; i++) {
+		nblocks = 0;
+		for (pp = page_free_list[i]; pp; pp = pp->pp_link)
+			nblocks++;
+		nfree += nblocks << i;
+		cprintf("%5d  %d\n", i, nblocks);
+	}
+	cprintf("%d of %d pages free in the buddy lists\n", nfree, npages);
+
+	for (i = 0; i < NCPU; i++) {
+		struct PageCache *pc = &page_caches[i];
+
+		if (!pc->pc_count && !pc->pc_hits && !pc->pc_refills)
+			continue;
+		cprintf("cpu %d page cache: %d pages, %d hits, %d refills, %d drains\n",
+			i, pc->pc_count, pc->pc_hits, pc->pc_refills, pc->pc_drains);
+	}
+
+	cprintf("zeroed pool: %d pages, %d hits, %d misses, %d zeroed while idle\n",
+		page_zero_count, page_zero_hits, page_zero_misses, page_zero_filled);
 }
 
 //
@@ -431,7 +884,22 @@ page_decref(struct PageInfo* pp)
 pte_t *
 pml4e_walk(pml4e_t *pml4e, const void *va, int create)
 {
-	return NULL;
+	pml4e_t *ent = &pml4e[PML4(va)];
+	struct PageInfo *pp = NULL;
+	pte_t *pte;
+
+	if (!(*ent & PTE_P)) {
+		if (!create || !(pp = page_alloc(ALLOC_ZERO)))
+			return NULL;
+		pp->pp_ref++;
+		*ent = page2pa(pp) | PTE_P | PTE_W | PTE_U;
+	}
+	pte = pdpe_walk(KADDR(PTE_ADDR(*ent)), va, create);
+	if (!pte && pp) {
+		*ent = 0;
+		page_decref(pp);
+	}
+	return pte;
 }
 
 
@@ -439,37 +907,296 @@ pml4e_walk(pml4e_t *pml4e, const void *va, int create)
 // The programming logic in this function is similar to pml4e_walk.
 // It calls the pgdir_walk which returns the page_table entry pointer.
 // Hints are the same as in pml4e_walk
+//
+// If 'va' is covered by a 1GB page, the PDPT entry itself is returned;
+// callers that care check it for PTE_PS.
 pte_t *
 pdpe_walk(pdpe_t *pdpe,const void *va,int create){
+	pdpe_t *ent = &pdpe[PDPE(va)];
+	struct PageInfo *pp = NULL;
+	pte_t *pte;
 
-	return NULL;
+	if ((*ent & (PTE_P | PTE_PS)) == (PTE_P | PTE_PS))
+		return ent;
+	if (!(*ent & PTE_P)) {
+		if (!create || !(pp = page_alloc(ALLOC_ZERO)))
+			return NULL;
+		pp->pp_ref++;
+		*ent = page2pa(pp) | PTE_P | PTE_W | PTE_U;
+	}
+	pte = pgdir_walk(KADDR(PTE_ADDR(*ent)), va, create);
+	if (!pte && pp) {
+		*ent = 0;
+		page_decref(pp);
+	}
+	return pte;
 }
 // Given 'pgdir', a pointer to a page directory, pgdir_walk returns
 // a pointer to the page table entry (PTE). 
 // The programming logic and the hints are the same as pml4e_walk
 // and pdpe_walk.
+//
+// If 'va' is covered by a 2MB page, the page directory entry itself
+// is returned.
 
 	pte_t *
 pgdir_walk(pde_t *pgdir, const void *va, int create)
 {
-	// Fill this function in
+	pde_t *ent = &pgdir[PDX(va)];
+	struct PageInfo *pp;
+
+	if ((*ent & (PTE_P | PTE_PS)) == (PTE_P | PTE_PS))
+		return ent;
+	if (!(*ent & PTE_P)) {
+		if (!create || !(pp = page_alloc(ALLOC_ZERO)))
+			return NULL;
+		pp->pp_ref++;
+		*ent = page2pa(pp) | PTE_P | PTE_W | PTE_U;
+	}
+	return (pte_t *) KADDR(PTE_ADDR(*ent)) + PTX(va);
+}
+
+// --------------------------------------------------------------
+// Page table cursors.
+// --------------------------------------------------------------
+
+//
+// Point 'c' at 'va' in the address space rooted at 'pml4e'.  Nothing
+// is walked until the cursor is used.
+//
+void
+ptc_init(struct PtCursor *c, pml4e_t *pml4e, uintptr_t va)
+{
+	c->ptc_pml4e = pml4e;
+	c->ptc_va = va;
+	c->ptc_pdpe = NULL;
+	c->ptc_pgdir = NULL;
+	c->ptc_pt = NULL;
+}
+
+//
+// Move the cursor 'size' bytes forward, forgetting only the tables
+// whose range it left.
+//
+void
+ptc_advance(struct PtCursor *c, size_t size)
+{
+	uintptr_t old = c->ptc_va;
+
+	c->ptc_va += size;
+	if ((old ^ c->ptc_va) >> PML4SHIFT)
+		c->ptc_pdpe = NULL;
+	if ((old ^ c->ptc_va) >> PDPESHIFT)
+		c->ptc_pgdir = NULL;
+	if ((old ^ c->ptc_va) >> PDXSHIFT)
+		c->ptc_pt = NULL;
+}
+
+//
+// Return the table that entry 'ent' points to, allocating an empty one
+// if it is not present and 'create' is set.  Returns NULL if the table
+// is missing, or if 'ent' maps a large page instead.
+//
+static uint64_t *
+ptc_table(uint64_t *ent, int create)
+{
+	struct PageInfo *pp;
+
+	if ((*ent & (PTE_P | PTE_PS)) == (PTE_P | PTE_PS))
+		return NULL;
+	if (!(*ent & PTE_P)) {
+		if (!create || !(pp = page_alloc(ALLOC_ZERO)))
+			return NULL;
+		pp->pp_ref++;
+		*ent = page2pa(pp) | PTE_P | PTE_W | PTE_U;
+	}
+	return KADDR(PTE_ADDR(*ent));
+}
+
+//
+// Return a pointer to the entry that maps the cursor's address with a
+// page of 'pgsize' bytes: the PDPT entry for PDPSIZE, the page
+// directory entry for PTSIZE, or the PTE for PGSIZE.  Missing tables
+// on the way are allocated if 'create' is set.
+//
+// Returns NULL if a table is missing (or cannot be allocated), or if
+// the address is already covered by a page larger than 'pgsize'.
+//
+pte_t *
+ptc_walk(struct PtCursor *c, size_t pgsize, int create)
+{
+	uintptr_t va = c->ptc_va;
+
+	if (!c->ptc_pdpe
+	    && !(c->ptc_pdpe = ptc_table(&c->ptc_pml4e[PML4(va)], create)))
+		return NULL;
+	if (pgsize == PDPSIZE)
+		return &c->ptc_pdpe[PDPE(va)];
+	if (!c->ptc_pgdir
+	    && !(c->ptc_pgdir = ptc_table(&c->ptc_pdpe[PDPE(va)], create)))
+		return NULL;
+	if (pgsize == PTSIZE)
+		return &c->ptc_pgdir[PDX(va)];
+	if (!c->ptc_pt
+	    && !(c->ptc_pt = ptc_table(&c->ptc_pgdir[PDX(va)], create)))
+		return NULL;
+	return &c->ptc_pt[PTX(va)];
+}
+
+//
+// Return the present entry that maps the cursor's address, at whatever
+// level it is, or NULL if the address is not mapped.
+//
+static pte_t *
+ptc_leaf(struct PtCursor *c)
+{
+	static const size_t sizes[] = { PDPSIZE, PTSIZE, PGSIZE };
+	pte_t *ent;
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		if (!(ent = ptc_walk(c, sizes[i], 0)) || !(*ent & PTE_P))
+			return NULL;
+		if (sizes[i] == PGSIZE || (*ent & PTE_PS))
+			return ent;
+	}
 	return NULL;
 }
 
+//
+// Like ptc_leaf, but also set *pgsize to the size of what the entry
+// maps, or, if the address is not mapped, of the region the missing
+// table or entry would have covered.  A walk over a range can then step
+// over a large page or an absent table in one go.
+//
+static pte_t *
+ptc_span(struct PtCursor *c, size_t *pgsize)
+{
+	static const size_t sizes[] = { PDPSIZE, PTSIZE, PGSIZE };
+	pte_t *ent;
+	int i;
+
+	*pgsize = (size_t) 1 << PML4SHIFT;
+	for (i = 0; i < 3; i++) {
+		if (!(ent = ptc_walk(c, sizes[i], 0)))
+			return NULL;
+		*pgsize = sizes[i];
+		if (!(*ent & PTE_P))
+			return NULL;
+		if (sizes[i] == PGSIZE || (*ent & PTE_PS))
+			return ent;
+	}
+	return NULL;
+}
+
+//
+// Map the cursor's address to 'pa' with a page of 'pgsize' bytes and
+// permissions perm|PTE_P, replacing whatever entry was there without
+// touching reference counts.  Both addresses must be aligned to
+// 'pgsize'.
+//
+// RETURNS:
+//   0 on success
+//   -E_NO_MEM, if a page table couldn't be allocated
+//   -E_INVAL, if the address is inside a larger page, or a large page
+//     would replace a page table
+//
+int
+ptc_map(struct PtCursor *c, physaddr_t pa, int perm, size_t pgsize)
+{
+	pte_t *ent;
+	int present;
+
+	assert(((c->ptc_va | pa) & (pgsize - 1)) == 0);
+	if (!(ent = ptc_walk(c, pgsize, 1)))
+		return ptc_leaf(c) ? -E_INVAL : -E_NO_MEM;
+	present = *ent & PTE_P;
+	if (present && pgsize != PGSIZE && !(*ent & PTE_PS))
+		return -E_INVAL;	// would orphan a page table
+	*ent = pa | perm | PTE_P | (pgsize == PGSIZE ? 0 : PTE_PS);
+	if (present)
+		tlb_invalidate(c->ptc_pml4e, (void *) c->ptc_va);
+	return 0;
+}
+
+//
+// Remove the mapping at the cursor's address, whatever its size, and
+// return the old entry (0 if there was none).  Reference counts are the
+// caller's business.  The TLB entry is queued on 'tg', or invalidated
+// right away if 'tg' is NULL.
+//
+pte_t
+ptc_unmap(struct PtCursor *c, struct TlbGather *tg)
+{
+	pte_t *ent, old;
+
+	if (!(ent = ptc_leaf(c)))
+		return 0;
+	old = *ent;
+	*ent = 0;
+	if (tg)
+		tlb_gather_add(tg, (void *) c->ptc_va, NULL);
+	else
+		tlb_invalidate(c->ptc_pml4e, (void *) c->ptc_va);
+	return old;
+}
+
+//
+// Change the permissions of the mapping at the cursor's address to
+// perm|PTE_P, keeping the frame and page size.  Returns -E_INVAL if
+// nothing is mapped there.
+//
+int
+ptc_protect(struct PtCursor *c, int perm)
+{
+	pte_t *ent;
+
+	if (!(ent = ptc_leaf(c)))
+		return -E_INVAL;
+	*ent = PTE_ADDR(*ent) | (*ent & PTE_PS) | perm | PTE_P;
+	tlb_invalidate(c->ptc_pml4e, (void *) c->ptc_va);
+	return 0;
+}
+
 //
 // Map [va, va+size) of virtual address space to physical [pa, pa+size)
 // in the page table rooted at pml4e.  Size is a multiple of PGSIZE.
 // Use permission bits perm|PTE_P for the entries.
 //
+// Each chunk is mapped with the largest page that both addresses are
+// aligned to and that fits in what is left: 1GB pages when the CPU
+// supports them, then 2MB pages, then 4KB pages.  A large page is only
+// used where no smaller table exists yet, so earlier 4KB mappings in
+// the same range are left alone.  The range is walked with a page
+// table cursor, so the tables are only looked up again at boundaries.
+//
 // This function is only intended to set up the ``static'' mappings
 // above UTOP. As such, it should *not* change the pp_ref field on the
 // mapped pages.
 //
-// Hint: the TA solution uses pml4e_walk
 	static void
 boot_map_region(pml4e_t *pml4e, uintptr_t la, size_t size, physaddr_t pa, int perm)
 {
-	// Fill this function in
+	struct PtCursor c;
+	pte_t *ent;
+	size_t pgsize;
+
+	ptc_init(&c, pml4e, la);
+	while (size > 0) {
+		for (pgsize = page1gb ? PDPSIZE : PTSIZE; pgsize > PGSIZE;
+		     pgsize = pgsize == PDPSIZE ? PTSIZE : PGSIZE) {
+			if ((c.ptc_va | pa) & (pgsize - 1) || size < pgsize)
+				continue;
+			ent = ptc_walk(&c, pgsize, 1);
+			if (ent && (!(*ent & PTE_P) || (*ent & PTE_PS)))
+				break;
+		}
+		if (ptc_map(&c, pa, perm, pgsize) < 0)
+			panic("boot_map_region: cannot map %lx", c.ptc_va);
+		ptc_advance(&c, pgsize);
+		pa += pgsize;
+		size -= pgsize;
+	}
 }
 
 //
@@ -484,23 +1211,26 @@ boot_map_region(pml4e_t *pml4e, uintptr_t la, size_t size, physaddr_t pa, int pe
 //   - pp->pp_ref should be incremented if the insertion succeeds.
 //   - The TLB must be invalidated if a page was formerly present at 'va'.
 //
-// Corner-case hint: Make sure to consider what happens when the same
-// pp is re-inserted at the same virtual address in the same pgdir.
-// However, try not to distinguish this case in your code, as this
-// frequently leads to subtle bugs; there's an elegant way to handle
-// everything in one code path.
-//
 // RETURNS:
 //   0 on success
 //   -E_NO_MEM, if page table couldn't be allocated
 //
-// Hint: The TA solution is implemented using pml4e_walk, page_remove,
-// and page2pa.
-//
 int
 page_insert(pml4e_t *pml4e, struct PageInfo *pp, void *va, int perm)
 {
-	// Fill this function in
+	pte_t *pte;
+
+	if (!(pte = pml4e_walk(pml4e, va, 1)))
+		return -E_NO_MEM;
+	if (*pte & PTE_PS)
+		panic("page_insert: %p is inside a large page", va);
+
+	// take the reference first, so re-inserting pp at the same va
+	// does not free it in page_remove
+	pp->pp_ref++;
+	if (*pte & PTE_P)
+		page_remove(pml4e, va);
+	*pte = page2pa(pp) | perm | PTE_P;
 	return 0;
 }
 
@@ -511,15 +1241,21 @@ page_insert(pml4e_t *pml4e, struct PageInfo *pp, void *va, int perm)
 // can be used to verify page permissions for syscall arguments,
 // but should not be used by most callers.
 //
-// Return NULL if there is no page mapped at va.
-//
-// Hint: the TA solution uses pml4e_walk and pa2page.
+// Return NULL if there is no page mapped at va.  Large pages map
+// boot-time memory that is not reference counted, so they are
+// reported as no page as well.
 //
 struct PageInfo *
 page_lookup(pml4e_t *pml4e, void *va, pte_t **pte_store)
 {
-	// Fill this function in
-	return NULL;
+	pte_t *pte;
+
+	pte = pml4e_walk(pml4e, va, 0);
+	if (!pte || !(*pte & PTE_P) || (*pte & PTE_PS))
+		return NULL;
+	if (pte_store)
+		*pte_store = pte;
+	return pa2page(PTE_ADDR(*pte));
 }
 
 //
@@ -534,25 +1270,293 @@ page_lookup(pml4e_t *pml4e, void *va, pte_t **pte_store)
 //   - The TLB must be invalidated if you remove an entry from
 //     the page table.
 //
-// Hint: The TA solution is implemented using page_lookup,
-// 	tlb_invalidate, and page_decref.
-//
 void
 page_remove(pml4e_t *pml4e, void *va)
 {
-	// Fill this function in
+	struct PageInfo *pp;
+	pte_t *pte;
+
+	if (!(pp = page_lookup(pml4e, va, &pte)))
+		return;
+	*pte = 0;
+	tlb_invalidate(pml4e, va);
+	page_decref(pp);
+}
+
+//
+// Unmap every 4KB page in [va, va+size), like page_remove on each, but
+// with one TLB flush for the whole range.  A large page the range
+// covers entirely is unmapped as one entry, without touching reference
+// counts (see ptc_unmap); one it covers only in part is left alone.
+// Absent page tables are skipped whole.
+//
+void
+page_remove_range(pml4e_t *pml4e, void *va, size_t size)
+{
+	struct TlbGather tg;
+	struct PtCursor c;
+	uintptr_t end = (uintptr_t) va + size;
+	size_t pgsize, step;
+	pte_t *pte;
+
+	tlb_gather_init(&tg, pml4e);
+	ptc_init(&c, pml4e, (uintptr_t) va);
+	while (c.ptc_va < end) {
+		pte = ptc_span(&c, &pgsize);
+		step = pgsize - (c.ptc_va & (pgsize - 1));
+		if (pte && pgsize == PGSIZE) {
+			struct PageInfo *pp = pa2page(PTE_ADDR(*pte));
+
+			*pte = 0;
+			tlb_gather_add(&tg, (void *) c.ptc_va, pp);
+		} else if (pte && step == pgsize && c.ptc_va + pgsize <= end) {
+			*pte = 0;
+			tlb_gather_add(&tg, (void *) c.ptc_va, NULL);
+		}
+		ptc_advance(&c, step);
+	}
+	tlb_gather_flush(&tg);
+}
+
+// --------------------------------------------------------------
+// Process-context identifiers.
+// With CR4.PCIDE set, TLB entries are tagged with the PCID of the
+// address space that made them, so switching CR3 need not throw the
+// TLB away.  PCID 0 belongs to boot_pml4e.  The rest are handed out
+// round robin; once they have all been used, the next one is taken
+// from whichever address space holds it.  An address space owns its
+// PCID only while pcid_owner names its PML4, and a CR3 load with a
+// newly assigned PCID flushes whatever the previous owner left behind.
+// --------------------------------------------------------------
+
+static bool pcid_enabled;		// CR4.PCIDE is set
+static bool invpcid_enabled;		// the CPU has INVPCID
+static physaddr_t pcid_owner[NPCID];	// PML4 holding each PCID, or 0
+static int pcid_next = 1;		// where the round robin continues
+static uint64_t pcid_steals;		// PCIDs taken from another PML4
+
+// TLB statistics, shown by the 'tlbstat' monitor command.
+static uint64_t tlb_invlpgs;		// single-page invalidations
+static uint64_t tlb_invpcids;		// INVPCIDs for other address spaces
+static uint64_t tlb_full_flushes;	// CR3 reloads and per-PCID flushes
+static uint64_t tlb_global_flushes;	// CR4.PGE toggles
+static uint64_t tlb_gathered;		// pages that went through a gather
+
+int tlb_flush_threshold = 32;
+
+//
+// Turn on PCIDs if the CPU has them.  Must run with boot_pml4e loaded
+// and PCID 0 in CR3.
+//
+static void
+pcid_init(void)
+{
+	uint32_t eax, ebx, ecx;
+
+	cpuid(0, &eax, NULL, NULL, NULL);
+	cpuid(CPUID_FEATURES, NULL, NULL, &ecx, NULL);
+	if (!(ecx & CPUID_PCID))
+		return;
+	if (eax >= CPUID_STRUCT_EXT) {
+		cpuid(CPUID_STRUCT_EXT, NULL, &ebx, NULL, NULL);
+		invpcid_enabled = (ebx & CPUID_INVPCID) != 0;
+	}
+	pcid_owner[0] = boot_cr3;
+	lcr4(rcr4() | CR4_PCIDE);
+	pcid_enabled = 1;
+}
+
+//
+// Return the PCID the address space rooted at 'pml4e' holds, or -1 if
+// it has none.
+//
+static int
+pcid_of(pml4e_t *pml4e)
+{
+	physaddr_t pa = PADDR(pml4e);
+	int pcid = pa2page(pa)->pp_pcid;
+
+	return pcid_owner[pcid] == pa ? pcid : -1;
+}
+
+//
+// Give 'pml4e' the next PCID in the round robin, taking it from its
+// previous owner unless that is the running address space.
+//
+static int
+pcid_assign(pml4e_t *pml4e)
+{
+	physaddr_t cur = PTE_ADDR(rcr3());
+	int pcid;
+
+	do {
+		pcid = pcid_next;
+		pcid_next = (pcid_next == NPCID - 1) ? 1 : pcid_next + 1;
+	} while (pcid_owner[pcid] == cur);
+	if (pcid_owner[pcid])
+		pcid_steals++;
+	pcid_owner[pcid] = PADDR(pml4e);
+	pa2page(PADDR(pml4e))->pp_pcid = pcid;
+	return pcid;
+}
+
+//
+// Switch to the address space rooted at 'pml4e'.  If it still holds its
+// PCID, the TLB entries it left behind are kept.
+//
+void
+pmap_load(pml4e_t *pml4e)
+{
+	int pcid;
+
+	if (!pcid_enabled)
+		lcr3(PADDR(pml4e));
+	else if ((pcid = pcid_of(pml4e)) >= 0)
+		lcr3(PADDR(pml4e) | pcid | CR3_NOFLUSH);
+	else
+		lcr3(PADDR(pml4e) | pcid_assign(pml4e));
+}
+
+//
+// Give up the PCID of an address space.  Must be called before its
+// PML4 page is freed, or a later PML4 in the same page would inherit
+// the PCID along with stale TLB entries.
+//
+void
+pcid_free(pml4e_t *pml4e)
+{
+	int pcid;
+
+	if ((pcid = pcid_of(pml4e)) > 0)
+		pcid_owner[pcid] = 0;
+}
+
+static bool
+tlb_is_current(pml4e_t *pml4e)
+{
+	return PTE_ADDR(rcr3()) == PADDR(pml4e);
 }
 
 //
 // Invalidate a TLB entry, but only if the page tables being
-// edited are the ones currently in use by the processor.
+// edited are ones the TLB may hold entries for: the current address
+// space, or another one that still holds a PCID.  Above ULIM the entry
+// may be global, which only invlpg removes, whatever CR3 holds.
 //
 	void
 tlb_invalidate(pml4e_t *pml4e, void *va)
 {
-	// Flush the entry only if we're modifying the current address space.
-	// For now, there is only one address space, so always invalidate.
-	invlpg(va);
+	int pcid;
+
+	if (tlb_is_current(pml4e) || (uintptr_t) va >= ULIM) {
+		invlpg(va);
+		tlb_invlpgs++;
+	}
+	if (tlb_is_current(pml4e))
+		return;
+	if ((pcid = pcid_of(pml4e)) >= 0) {
+		if (invpcid_enabled) {
+			invpcid(INVPCID_ADDR, pcid, (uintptr_t) va);
+			tlb_invpcids++;
+		} else
+			pcid_owner[pcid] = 0;	// its next load flushes instead
+	}
+}
+
+//
+// Flush the whole TLB, global entries and every PCID included.
+//
+static void
+tlbflush_global(void)
+{
+	uint64_t cr4 = rcr4();
+
+	lcr4(cr4 & ~CR4_PGE);
+	lcr4(cr4);
+}
+
+//
+// Invalidate every non-global TLB entry of one address space, or with
+// 'global', every TLB entry there is.
+//
+static void
+tlb_flush_pml4e(pml4e_t *pml4e, bool global)
+{
+	int pcid;
+
+	if (global) {
+		tlbflush_global();
+		tlb_global_flushes++;
+	} else if (tlb_is_current(pml4e)) {
+		tlbflush();
+		tlb_full_flushes++;
+	} else if ((pcid = pcid_of(pml4e)) >= 0) {
+		if (invpcid_enabled) {
+			invpcid(INVPCID_PCID, pcid, 0);
+			tlb_full_flushes++;
+		} else
+			pcid_owner[pcid] = 0;
+	}
+}
+
+void
+tlb_gather_init(struct TlbGather *tg, pml4e_t *pml4e)
+{
+	tg->tg_pml4e = pml4e;
+	tg->tg_count = 0;
+	tg->tg_global = 0;
+}
+
+//
+// Queue the invalidation of 'va', whose page table entry the caller has
+// already cleared.  If 'pp' is not NULL, it loses a reference once the
+// TLB no longer maps it.  A full gather is flushed on the spot.
+//
+void
+tlb_gather_add(struct TlbGather *tg, void *va, struct PageInfo *pp)
+{
+	if (tg->tg_count == TLB_GATHER_MAX)
+		tlb_gather_flush(tg);
+	tg->tg_va[tg->tg_count] = (uintptr_t) va;
+	tg->tg_pages[tg->tg_count] = pp;
+	tg->tg_count++;
+	if ((uintptr_t) va >= ULIM)
+		tg->tg_global = 1;
+}
+
+//
+// Invalidate everything queued on 'tg', then drop the page references.
+//
+void
+tlb_gather_flush(struct TlbGather *tg)
+{
+	int i;
+
+	if (tg->tg_count == 0)
+		return;
+	if (tg->tg_count > tlb_flush_threshold)
+		tlb_flush_pml4e(tg->tg_pml4e, tg->tg_global);
+	else
+		for (i = 0; i < tg->tg_count; i++)
+			tlb_invalidate(tg->tg_pml4e, (void *) tg->tg_va[i]);
+	tlb_gathered += tg->tg_count;
+
+	for (i = 0; i < tg->tg_count; i++)
+		if (tg->tg_pages[i])
+			page_decref(tg->tg_pages[i]);
+	tg->tg_count = 0;
+	tg->tg_global = 0;
+}
+
+void
+tlb_print_stats(void)
+{
+	cprintf("%d invlpg, %d invpcid, %d full flushes, %d global flushes\n",
+		tlb_invlpgs, tlb_invpcids, tlb_full_flushes, tlb_global_flushes);
+	cprintf("%d pages gathered, full flush above %d pages\n",
+		tlb_gathered, tlb_flush_threshold);
+	cprintf("pcid %s, invpcid %s, %d pcids taken over\n",
+		pcid_enabled ? "on" : "off", invpcid_enabled ? "on" : "off", pcid_steals);
 }
 
 
@@ -567,58 +1571,119 @@ tlb_invalidate(pml4e_t *pml4e, void *va)
 static void
 check_page_free_list(bool only_low_memory)
 {
-	struct PageInfo *pp;
+	struct PageInfo *blk, *pp;
 	unsigned pdx_limit = only_low_memory ? 1 : NPDENTRIES;
 	uint64_t nfree_basemem = 0, nfree_extmem = 0;
 	char *first_free_page;
+	int o, i, nonempty = 0;
+
+	// put the pages parked in the per-CPU caches and the pre-zeroed
+	// pool back on the lists
+	page_cache_drain_all();
+	page_zero_drain();
 
-	if (!page_free_list)
+	for (o = 0; o <= PAGE_MAX_ORDER; o++)
+		if (page_free_list[o])
+			nonempty = 1;
+	if (!nonempty)
 		panic("'page_free_list' is a null pointer!");
 
-	if (only_low_memory) {
-		// Move pages with lower addresses first in the free
-		// list, since entry_pgdir does not map all pages.
-		struct PageInfo *pp1, *pp2;
-		struct PageInfo **tp[2] = { &pp1, &pp2 };
-		for (pp = page_free_list; pp; pp = pp->pp_link) {
-			int pagetype = PDX(page2pa(pp)) >= pdx_limit;
-			*tp[pagetype] = pp;
-			tp[pagetype] = &pp->pp_link;
-		}
-		*tp[1] = 0;
-		*tp[0] = pp2;
-		page_free_list = pp1;
-	}
+	// The buddy allocator decides which block each allocation comes
+	// from, so unlike the old single list there is no way to move low
+	// pages to the front.  Everything below the boot_alloc limit is
+	// mapped by the boot page table anyway.
 
 	// if there's a page that shouldn't be on the free list,
 	// try to make sure it eventually causes trouble.
-	for (pp = page_free_list; pp; pp = pp->pp_link)
-		if (PDX(page2pa(pp)) < pdx_limit)
-			memset(page2kva(pp), 0x97, 128);
+	for (o = 0; o <= PAGE_MAX_ORDER; o++)
+		for (blk = page_free_list[o]; blk; blk = blk->pp_link)
+			for (i = 0; i < (1 << o); i++)
+				if (PDX(page2pa(blk + i)) < pdx_limit)
+					memset(page2kva(blk + i), 0x97, 128);
 
 	first_free_page = (char *) boot_alloc(0);
-	for (pp = page_free_list; pp; pp = pp->pp_link) {
-		// check that we didn't corrupt the free list itself
-		assert(pp >= pages);
-		assert(pp < pages + npages);
-		assert(((char *) pp - (char *) pages) % sizeof(*pp) == 0);
+	for (o = 0; o <= PAGE_MAX_ORDER; o++)
+		for (blk = page_free_list[o]; blk; blk = blk->pp_link) {
+			// check that we didn't corrupt the free list itself
+			assert(blk >= pages);
+			assert(blk + (1 << o) <= pages + npages);
+			assert(((char *) blk - (char *) pages) % sizeof(*blk) == 0);
+			assert((blk->pp_flags & PP_FREE) && blk->pp_order == o);
+			assert((page2ppn(blk) & ((1 << o) - 1)) == 0);
+			assert(*blk->pp_pprev == blk);
+
+			for (i = 0; i < (1 << o); i++) {
+				pp = blk + i;
+
+				// check a few pages that shouldn't be on the free list
+				assert(page2pa(pp) != 0);
+				assert(page2pa(pp) != IOPHYSMEM);
+				assert(page2pa(pp) != EXTPHYSMEM - PGSIZE);
+				assert(page2pa(pp) != EXTPHYSMEM);
+				assert(page2pa(pp) < EXTPHYSMEM || (char *) page2kva(pp) >= first_free_page);
+				// the section tables translate both ways
+				assert(pa2page(page2pa(pp)) == pp);
+
+				if (page2pa(pp) < EXTPHYSMEM)
+					++nfree_basemem;
+				else
+					++nfree_extmem;
+			}
+		}
 
-		// check a few pages that shouldn't be on the free list
-		assert(page2pa(pp) != 0);
-		assert(page2pa(pp) != IOPHYSMEM);
-		assert(page2pa(pp) != EXTPHYSMEM - PGSIZE);
-		assert(page2pa(pp) != EXTPHYSMEM);
-		assert(page2pa(pp) < EXTPHYSMEM || (char *) page2kva(pp) >= first_free_page);
+	assert(nfree_extmem > 0);
+}
 
-		if (page2pa(pp) < EXTPHYSMEM)
-			++nfree_basemem;
-		else
-			++nfree_extmem;
+//
+// Take every free block off the free lists, so the checks below can run
+// the allocator dry.  The per-CPU caches are drained first so that they
+// cannot hand out pages either.  Stolen blocks lose PP_FREE so that
+// pages freed in the meantime cannot coalesce with them.
+//
+static void
+check_steal_free_lists(struct PageInfo **fl)
+{
+	struct PageInfo *pp;
+	int o;
+
+	page_cache_drain_all();
+	page_zero_drain();
+	for (o = 0; o <= PAGE_MAX_ORDER; o++) {
+		fl[o] = page_free_list[o];
+		page_free_list[o] = NULL;
+		for (pp = fl[o]; pp; pp = pp->pp_link)
+			pp->pp_flags &= ~PP_FREE;
 	}
+}
 
-	assert(nfree_extmem > 0);
+// Give back the blocks taken by check_steal_free_lists.
+static void
+check_return_free_lists(struct PageInfo **fl)
+{
+	struct PageInfo *pp, *next;
+	int o;
+
+	for (o = 0; o <= PAGE_MAX_ORDER; o++)
+		for (pp = fl[o]; pp; pp = next) {
+			next = pp->pp_link;
+			pp->pp_link = NULL;
+			page_free_order(pp, o);
+		}
 }
 
+// Count the pages sitting on the free lists.
+static size_t
+check_nfree_pages(void)
+{
+	struct PageInfo *pp;
+	size_t n = 0;
+	int o;
+
+	for (o = 0; o <= PAGE_MAX_ORDER; o++)
+		for (pp = page_free_list[o]; pp; pp = pp->pp_link)
+			n += 1 << o;
+	return n;
+}
 
 //
 // Check the physical page allocator (page_alloc(), page_free(),
@@ -629,28 +1694,30 @@ check_page_alloc(void)
 {
 	struct PageInfo *pp, *pp0, *pp1, *pp2;
 	int nfree;
-	struct PageInfo *fl;
+	struct PageInfo *fl[PAGE_MAX_ORDER + 1];
 	char *c;
-	int i;
+	int i, o;
 
 	// if there's a page that shouldn't be on
 	// the free list, try to make sure it
 	// eventually causes trouble.
-	for (pp0 = page_free_list, nfree = 0; pp0; pp0 = pp0->pp_link) {
-		memset(page2kva(pp0), 0x97, PGSIZE);
-	}
-
-	for (pp0 = page_free_list, nfree = 0; pp0; pp0 = pp0->pp_link) {
-		// check that we didn't corrupt the free list itself
-		assert(pp0 >= pages);
-		assert(pp0 < pages + npages);
-
-		// check a few pages that shouldn't be on the free list
-		assert(page2pa(pp0) != 0);
-		assert(page2pa(pp0) != IOPHYSMEM);
-		assert(page2pa(pp0) != EXTPHYSMEM - PGSIZE);
-		assert(page2pa(pp0) != EXTPHYSMEM);
-	}
+	for (o = 0; o <= PAGE_MAX_ORDER; o++)
+		for (pp0 = page_free_list[o]; pp0; pp0 = pp0->pp_link)
+			memset(page2kva(pp0), 0x97, PGSIZE << o);
+
+	for (o = 0; o <= PAGE_MAX_ORDER; o++)
+		for (pp0 = page_free_list[o]; pp0; pp0 = pp0->pp_link)
+			for (pp = pp0; pp < pp0 + (1 << o); pp++) {
+				// check that we didn't corrupt the free list itself
+				assert(pp >= pages);
+				assert(pp < pages + npages);
+
+				// check a few pages that shouldn't be on the free list
+				assert(page2pa(pp) != 0);
+				assert(page2pa(pp) != IOPHYSMEM);
+				assert(page2pa(pp) != EXTPHYSMEM - PGSIZE);
+				assert(page2pa(pp) != EXTPHYSMEM);
+			}
 	// should be able to allocate three pages
 	pp0 = pp1 = pp2 = 0;
 	assert((pp0 = page_alloc(0)));
@@ -659,13 +1726,12 @@ check_page_alloc(void)
 	assert(pp0);
 	assert(pp1 && pp1 != pp0);
 	assert(pp2 && pp2 != pp1 && pp2 != pp0);
-	assert(page2pa(pp0) < npages*PGSIZE);
-	assert(page2pa(pp1) < npages*PGSIZE);
-	assert(page2pa(pp2) < npages*PGSIZE);
+	assert(page2pa(pp0) < maxpa);
+	assert(page2pa(pp1) < maxpa);
+	assert(page2pa(pp2) < maxpa);
 
 	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	page_free_list = 0;
+	check_steal_free_lists(fl);
 
 	// should be no free memory
 	assert(!page_alloc(0));
@@ -693,7 +1759,7 @@ check_page_alloc(void)
 		assert(c[i] == 0);
 
 	// give free list back
-	page_free_list = fl;
+	check_return_free_lists(fl);
 
 	// free the pages we took
 	page_free(pp0);
@@ -703,6 +1769,412 @@ check_page_alloc(void)
 	cprintf("check_page_alloc() succeeded!\n");
 }
 
+//
+// Check the buddy allocator: alignment of multi-page blocks, splitting,
+// and coalescing back into the original block on free.
+//
+static void
+check_page_alloc_order(void)
+{
+	struct PageInfo *pp, *pp0, *pp1, *pp2;
+	struct PageInfo *fl[PAGE_MAX_ORDER + 1];
+	size_t nfree;
+	char *c;
+	int i, o;
+
+	page_cache_drain_all();
+	page_zero_drain();
+	nfree = check_nfree_pages();
+
+	// every order should hand out a naturally aligned block
+	for (o = 0; o <= PAGE_MAX_ORDER; o++) {
+		if (!(pp = page_alloc_order(o, 0)))
+			continue;
+		assert((page2ppn(pp) & ((1 << o) - 1)) == 0);
+		assert((pp - pages) + (1 << o) <= npages);
+		assert(!(pp->pp_flags & PP_FREE) && pp->pp_link == NULL);
+		assert(check_nfree_pages() == nfree - (1 << o));
+		page_free_order(pp, o);
+		assert(check_nfree_pages() == nfree);
+	}
+	assert(!page_alloc_order(PAGE_MAX_ORDER + 1, 0));
+
+	// ALLOC_ZERO clears the whole block
+	assert((pp = page_alloc_order(1, 0)));
+	memset(page2kva(pp), 1, 2 * PGSIZE);
+	page_free_order(pp, 1);
+	assert((pp = page_alloc_order(1, ALLOC_ZERO)));
+	c = page2kva(pp);
+	for (i = 0; i < 2 * PGSIZE; i++)
+		assert(c[i] == 0);
+	page_free_order(pp, 1);
+
+	// take one order-2 block and run the allocator dry
+	assert((pp = page_alloc_order(2, 0)));
+	check_steal_free_lists(fl);
+	assert(!page_alloc(0));
+
+	// splitting it should give out all four pages and nothing else
+	page_free_order(pp, 2);
+	assert((pp0 = page_alloc_order(0, 0)) == pp);
+	assert((pp1 = page_alloc_order(1, 0)) == pp + 2);
+	assert((pp2 = page_alloc_order(0, 0)) == pp + 1);
+	assert(!page_alloc_order(0, 0));
+
+	// freeing the pieces in any order merges them back into one block
+	page_free_order(pp1, 1);
+	page_free_order(pp0, 0);
+	assert(page_free_list[1] == pp1 && page_free_list[0] == pp0);
+	page_free_order(pp2, 0);
+	assert(page_free_list[0] == NULL && page_free_list[1] == NULL);
+	assert(page_free_list[2] == pp && pp->pp_order == 2);
+	assert(page_alloc_order(2, 0) == pp);
+
+	check_return_free_lists(fl);
+	page_free_order(pp, 2);
+	assert(check_nfree_pages() == nfree);
+
+	cprintf("check_page_alloc_order() succeeded!\n");
+}
+
+//
+// Check the per-CPU page cache: a freed page is kept for the next
+// allocation, an empty cache refills in one batch, and a full one
+// drains a batch back to the buddy lists.
+//
+static void
+check_page_cache(void)
+{
+	struct PageCache *pc = &page_caches[cpunum()];
+	struct PageInfo *pp0, *held[PAGE_CACHE_HIGH + 1];
+	uint64_t refills, drains;
+	size_t nfree;
+	int i;
+
+	page_cache_drain_all();
+	page_zero_drain();
+	nfree = check_nfree_pages();
+	assert(pc->pc_count == 0);
+
+	// an empty cache refills a whole batch from the buddy lists
+	refills = pc->pc_refills;
+	assert((pp0 = page_alloc(0)));
+	assert(pc->pc_refills == refills + 1);
+	assert(pc->pc_count == PAGE_CACHE_BATCH - 1);
+	assert(check_nfree_pages() == nfree - PAGE_CACHE_BATCH);
+	assert(!(pp0->pp_flags & PP_CACHED));
+
+	// a freed page is the next one handed out, without a refill
+	page_free(pp0);
+	assert(pp0->pp_flags & PP_CACHED);
+	assert(page_alloc(0) == pp0);
+	assert(pc->pc_refills == refills + 1);
+
+	// overfilling the cache drains its coldest batch
+	for (i = 0; i < PAGE_CACHE_HIGH; i++)
+		assert((held[i] = page_alloc(0)));
+	held[PAGE_CACHE_HIGH] = pp0;
+	page_cache_drain_all();
+	drains = pc->pc_drains;
+	for (i = 0; i <= PAGE_CACHE_HIGH; i++)
+		page_free(held[i]);
+	assert(pc->pc_drains == drains + 1);
+	assert(pc->pc_count == PAGE_CACHE_HIGH - PAGE_CACHE_BATCH + 1);
+	assert(!(held[0]->pp_flags & PP_CACHED));
+	assert(held[PAGE_CACHE_HIGH]->pp_flags & PP_CACHED);
+
+	page_cache_drain_all();
+	assert(check_nfree_pages() == nfree);
+
+	cprintf("check_page_cache() succeeded!\n");
+}
+
+//
+// Check that the idle loop fills the pre-zeroed pool, that ALLOC_ZERO
+// is served from it, and that it falls back to zeroing by hand once
+// the pool is empty.
+//
+static void
+check_page_zero(void)
+{
+	struct PageInfo *pp;
+	uint64_t hits, misses;
+	size_t nfree;
+	char *c;
+	int i;
+
+	page_cache_drain_all();
+	page_zero_drain();
+	nfree = check_nfree_pages();
+
+	assert(page_zero_idle(PAGE_ZERO_POOL + 1) == PAGE_ZERO_POOL);
+	assert(page_zero_count == PAGE_ZERO_POOL);
+	assert(page_zero_idle(1) == 0);
+	assert(check_nfree_pages() == nfree - PAGE_ZERO_POOL);
+
+	// every pooled page is zero
+	for (pp = page_zero_list, i = 0; pp; pp = pp->pp_link, i++) {
+		assert(pp->pp_flags & PP_ZEROED);
+		c = page2kva(pp);
+		assert(c[0] == 0 && c[PGSIZE / 2] == 0 && c[PGSIZE - 1] == 0);
+	}
+	assert(i == PAGE_ZERO_POOL);
+
+	// ALLOC_ZERO takes from the pool; plain allocations leave it alone
+	hits = page_zero_hits;
+	assert((pp = page_alloc(ALLOC_ZERO)));
+	assert(page_zero_hits == hits + 1);
+	assert(page_zero_count == PAGE_ZERO_POOL - 1);
+	assert(!(pp->pp_flags & PP_ZEROED) && pp->pp_link == NULL);
+	page_free(pp);
+	assert((pp = page_alloc(0)));
+	assert(page_zero_count == PAGE_ZERO_POOL - 1);
+	page_free(pp);
+
+	// an empty pool falls back to zeroing synchronously
+	page_zero_drain();
+	assert(page_zero_count == 0);
+	misses = page_zero_misses;
+	assert((pp = page_alloc(0)));
+	memset(page2kva(pp), 0xAB, PGSIZE);
+	page_free(pp);
+	assert(page_alloc(ALLOC_ZERO) == pp);
+	assert(page_zero_misses == misses + 1);
+	c = page2kva(pp);
+	for (i = 0; i < PGSIZE; i++)
+		assert(c[i] == 0);
+	page_free(pp);
+
+	page_cache_drain_all();
+	assert(check_nfree_pages() == nfree);
+
+	cprintf("check_page_zero() succeeded!\n");
+}
+
+//
+// Free the page tables the checks built below 1GB in boot_pml4e.
+//
+static void
+check_free_low_tables(void)
+{
+	pdpe_t *pdpe = KADDR(PTE_ADDR(boot_pml4e[0]));
+	pde_t *pgdir = KADDR(PTE_ADDR(pdpe[0]));
+	int i;
+
+	for (i = 0; i < NPDENTRIES; i++)
+		if ((pgdir[i] & PTE_P) && !(pgdir[i] & PTE_PS))
+			page_decref(pa2page(PTE_ADDR(pgdir[i])));
+	page_decref(pa2page(PTE_ADDR(pdpe[0])));
+	page_decref(pa2page(PTE_ADDR(boot_pml4e[0])));
+	boot_pml4e[0] = 0;
+}
+
+//
+// Check the page table cursor: mapping across a page table boundary
+// re-walks only the level that changed, and protect, unmap and large
+// pages behave.
+//
+static void
+check_pt_cursor(void)
+{
+	struct PtCursor c;
+	struct PageInfo *pp;
+	pde_t *pgdir;
+	pte_t *pt, *pte;
+	uintptr_t va, start = PTSIZE - 2 * PGSIZE;
+	size_t nfree;
+	int i;
+
+	assert(!(boot_pml4e[0] & PTE_P));
+	page_cache_drain_all();
+	page_zero_drain();
+	nfree = check_nfree_pages();
+	assert((pp = page_alloc(0)));
+
+	// four pages straddling the boundary between two page tables
+	ptc_init(&c, boot_pml4e, start);
+	for (i = 0; i < 4; i++) {
+		assert(ptc_map(&c, page2pa(pp), PTE_W, PGSIZE) == 0);
+		if (i == 0) {
+			pgdir = c.ptc_pgdir;
+			pt = c.ptc_pt;
+		}
+		assert(c.ptc_pgdir == pgdir);
+		assert((c.ptc_pt == pt) == (i < 2));
+		ptc_advance(&c, PGSIZE);
+	}
+	for (va = start; va < start + 4 * PGSIZE; va += PGSIZE)
+		assert(check_va2pa(boot_pml4e, va) == page2pa(pp));
+	assert(check_va2pa(boot_pml4e, start - PGSIZE) == ~0);
+
+	// protect
+	ptc_init(&c, boot_pml4e, start);
+	for (i = 0; i < 4; i++, ptc_advance(&c, PGSIZE))
+		assert(ptc_protect(&c, PTE_U) == 0);
+	for (va = start; va < start + 4 * PGSIZE; va += PGSIZE) {
+		pte = pml4e_walk(boot_pml4e, (void *) va, 0);
+		assert((*pte & PTE_U) && !(*pte & PTE_W));
+		assert(PTE_ADDR(*pte) == page2pa(pp));
+	}
+	assert(ptc_protect(&c, PTE_U) == -E_INVAL);
+
+	// a 2MB page, and a 4KB page that would fall inside it
+	ptc_init(&c, boot_pml4e, 4 * PTSIZE);
+	assert(ptc_map(&c, 0, PTE_W, PTSIZE) == 0);
+	assert(check_va2pgsize(boot_pml4e, 4 * PTSIZE + 5 * PGSIZE) == PTSIZE);
+	assert(check_va2pa(boot_pml4e, 4 * PTSIZE + 5 * PGSIZE) == 5 * PGSIZE);
+	ptc_advance(&c, 5 * PGSIZE);
+	assert(ptc_map(&c, page2pa(pp), PTE_W, PGSIZE) == -E_INVAL);
+	assert(ptc_unmap(&c, NULL) & PTE_PS);
+	assert(check_va2pa(boot_pml4e, 4 * PTSIZE) == ~0);
+
+	// unmap
+	ptc_init(&c, boot_pml4e, start);
+	for (i = 0; i < 4; i++, ptc_advance(&c, PGSIZE))
+		assert(PTE_ADDR(ptc_unmap(&c, NULL)) == page2pa(pp));
+	for (va = start; va < start + 4 * PGSIZE; va += PGSIZE)
+		assert(check_va2pa(boot_pml4e, va) == ~0);
+	assert(ptc_unmap(&c, NULL) == 0);
+
+	// give back the page tables and the page
+	check_free_low_tables();
+	page_free(pp);
+
+	page_cache_drain_all();
+	assert(check_nfree_pages() == nfree);
+
+	cprintf("check_pt_cursor() succeeded!\n");
+}
+
+//
+// Check that page_remove_range batches its invalidations, switches to a
+// full flush above tlb_flush_threshold, and only frees pages after the
+// flush.
+//
+static void
+check_tlb_gather(void)
+{
+	struct PageInfo *pp;
+	struct TlbGather tg;
+	struct PtCursor c;
+	uint64_t invlpgs, full, global;
+	size_t nfree;
+	int i, n;
+
+	assert(!(boot_pml4e[0] & PTE_P));
+	assert(tlb_flush_threshold < TLB_GATHER_MAX);
+	page_cache_drain_all();
+	page_zero_drain();
+	nfree = check_nfree_pages();
+	assert((pp = page_alloc(0)));
+
+	// a small range: one invlpg per page
+	n = tlb_flush_threshold;
+	for (i = 0; i < n; i++)
+		assert(page_insert(boot_pml4e, pp, (void *) (uintptr_t) (i * PGSIZE), PTE_W) == 0);
+	invlpgs = tlb_invlpgs;
+	full = tlb_full_flushes;
+	page_remove_range(boot_pml4e, 0, n * PGSIZE);
+	assert(tlb_invlpgs == invlpgs + n && tlb_full_flushes == full);
+	for (i = 0; i < n; i++)
+		assert(check_va2pa(boot_pml4e, i * PGSIZE) == ~0);
+	assert(pp->pp_ref == 0 && (pp->pp_flags & PP_CACHED));
+	assert(page_alloc(0) == pp);
+
+	// more than a gather holds: a full flush for the first batch, and
+	// invlpgs for the small remainder
+	n = TLB_GATHER_MAX + 4;
+	for (i = 0; i < n; i++)
+		assert(page_insert(boot_pml4e, pp, (void *) (uintptr_t) (i * PGSIZE), PTE_W) == 0);
+	invlpgs = tlb_invlpgs;
+	full = tlb_full_flushes;
+	page_remove_range(boot_pml4e, 0, PTSIZE);
+	assert(tlb_full_flushes == full + 1 && tlb_invlpgs == invlpgs + 4);
+	assert(pp->pp_ref == 0);
+
+	// a large page goes as one entry, but only if the range covers
+	// all of it; the absent tables around it are stepped over
+	ptc_init(&c, boot_pml4e, PTSIZE);
+	assert(ptc_map(&c, 0, PTE_W, PTSIZE) == 0);
+	page_remove_range(boot_pml4e, (void *) PTSIZE, PTSIZE / 2);
+	assert(check_va2pa(boot_pml4e, PTSIZE) == 0);
+	invlpgs = tlb_invlpgs;
+	page_remove_range(boot_pml4e, 0, (size_t) 1 << PML4SHIFT);
+	assert(tlb_invlpgs == invlpgs + 1);
+	assert(check_va2pa(boot_pml4e, PTSIZE) == ~0);
+
+	// kernel addresses may be cached global, out of reach of a CR3
+	// reload; flushing them is harmless, as nothing is unmapped
+	tlb_gather_init(&tg, boot_pml4e);
+	for (i = 0; i <= tlb_flush_threshold; i++)
+		tlb_gather_add(&tg, (void *) (KERNBASE + i * PGSIZE), NULL);
+	assert(tg.tg_global);
+	full = tlb_full_flushes;
+	global = tlb_global_flushes;
+	tlb_gather_flush(&tg);
+	assert(tlb_global_flushes == global + 1 && tlb_full_flushes == full);
+	assert(tg.tg_count == 0 && !tg.tg_global);
+
+	check_free_low_tables();
+	page_cache_drain_all();
+	assert(check_nfree_pages() == nfree);
+
+	cprintf("check_tlb_gather() succeeded!\n");
+}
+
+//
+// Check PCID assignment and takeover.  The two PML4s are never loaded,
+// so this runs the same whether or not the CPU has PCIDs.
+//
+static void
+check_pcid(void)
+{
+	struct PageInfo *pa, *pb;
+	pml4e_t *a, *b;
+	uint64_t steals = pcid_steals;
+	int pcid, next = pcid_next;
+
+	assert(pcid_of(boot_pml4e) == (pcid_enabled ? 0 : -1));
+
+	assert((pa = page_alloc(ALLOC_ZERO)) && (pb = page_alloc(ALLOC_ZERO)));
+	a = page2kva(pa);
+	b = page2kva(pb);
+	assert(pcid_of(a) == -1 && pcid_of(b) == -1);
+
+	// a gets the next PCID and keeps it
+	pcid = pcid_assign(a);
+	assert(pcid > 0 && pcid < NPCID && pcid == next);
+	assert(pcid_of(a) == pcid && pcid_of(b) == -1);
+
+	// wrap the round robin around onto a's PCID: b takes it over
+	pcid_next = pcid;
+	assert(pcid_assign(b) == pcid);
+	assert(pcid_steals == steals + 1);
+	assert(pcid_of(a) == -1 && pcid_of(b) == pcid);
+
+	// the PCID after the last one is 1, never 0
+	pcid_next = NPCID - 1;
+	assert(pcid_assign(a) == NPCID - 1);
+	assert(pcid_next == 1);
+
+	// invalidating in an address space that is not loaded either
+	// targets its PCID or costs it the PCID
+	tlb_invalidate(b, (void *) UTEXT);
+	assert(pcid_of(b) == (invpcid_enabled ? pcid : -1));
+
+	pcid_free(a);
+	pcid_free(b);
+	assert(pcid_of(a) == -1 && pcid_of(b) == -1);
+	assert(pcid_of(boot_pml4e) == (pcid_enabled ? 0 : -1));
+
+	pcid_next = next;
+	pcid_steals = steals;
+	page_free(pa);
+	page_free(pb);
+
+	cprintf("check_pcid() succeeded!\n");
+}
+
 //
 // Checks that the kernel part of virtual address space
 // has been setup roughly correctly (by x64_vm_init()).
@@ -711,6 +2183,26 @@ check_page_alloc(void)
 // but it is a pretty good sanity check.
 //
 
+//
+// Check that [start, end) is mapped at KERNBASE + start, one mapping at
+// a time.  KERNBASE is 2MB aligned, so every whole 2MB chunk of the
+// range should be a large page.
+//
+static void
+check_direct_map(pml4e_t *pml4e, physaddr_t start, physaddr_t end)
+{
+	physaddr_t pa;
+	size_t sz;
+
+	for (pa = start; pa < end; pa += sz - (pa & (sz - 1))) {
+		assert(check_va2pa(pml4e, KERNBASE + pa) == pa);
+		assert(check_va2leaf(pml4e, KERNBASE + pa) & PTE_G);
+		sz = check_va2pgsize(pml4e, KERNBASE + pa);
+		if (!(pa & (PTSIZE - 1)) && pa + PTSIZE <= end)
+			assert(sz >= PTSIZE);
+	}
+}
+
 static void
 check_boot_pml4e(pml4e_t *pml4e)
 {
@@ -719,20 +2211,25 @@ check_boot_pml4e(pml4e_t *pml4e)
 	pml4e = boot_pml4e;
 
 	// check pages array
-	n = ROUNDUP(npages*sizeof(struct PageInfo), PGSIZE);
+	n = upages_size();
 	for (i = 0; i < n; i += PGSIZE) {
 		// cprintf("%x %x %x\n",i,check_va2pa(pml4e, UPAGES + i), PADDR(pages) + i);
 		assert(check_va2pa(pml4e, UPAGES + i) == PADDR(pages) + i);
+		assert(!(check_va2leaf(pml4e, UPAGES + i) & PTE_G));
 	}
 
 
 	// check phys mem
-	for (i = 0; i < npages * PGSIZE; i += PGSIZE)
-		assert(check_va2pa(pml4e, KERNBASE + i) == i);
+	check_direct_map(pml4e, 0, EXTPHYSMEM);
+	for (i = 0; i < nmem_ranges; i++)
+		if (mem_ranges[i].mr_end > EXTPHYSMEM)
+			check_direct_map(pml4e, MAX(mem_ranges[i].mr_start, (physaddr_t) EXTPHYSMEM),
+					 mem_ranges[i].mr_end);
 
 	// check kernel stack
 	for (i = 0; i < KSTKSIZE; i += PGSIZE) {
 		assert(check_va2pa(pml4e, KSTACKTOP - KSTKSIZE + i) == PADDR(bootstack) + i);
+		assert(check_va2leaf(pml4e, KSTACKTOP - KSTKSIZE + i) & PTE_G);
     }
 	assert(check_va2pa(pml4e, KSTACKTOP - KSTKSIZE - 1 )  == ~0);
 
@@ -756,13 +2253,44 @@ check_boot_pml4e(pml4e_t *pml4e)
 				break;
 		}
 	}
+
+	// nothing the user can reach may be global
+	check_not_global(pml4e, 3, 0);
+
 	cprintf("check_boot_pml4e() succeeded!\n");
 }
 
+//
+// Check that no mapping under 'table', a level 'level' table (3 for the
+// PML4, 0 for a page table) covering addresses from 'va' up, is global
+// if it lies below ULIM or is user-accessible.  A global user mapping
+// would survive CR3 switches into other address spaces.
+//
+static void
+check_not_global(uint64_t *table, int level, uintptr_t va)
+{
+	uintptr_t size = (uintptr_t) PGSIZE << (9 * level);
+	uint64_t ent;
+	int i;
+
+	for (i = 0; i < NPTENTRIES; i++, va += size) {
+		ent = table[i];
+		if (!(ent & PTE_P))
+			continue;
+		if (level == 0 || (level < 3 && (ent & PTE_PS))) {
+			if (va < ULIM || (ent & PTE_U))
+				assert(!(ent & PTE_G));
+		} else
+			check_not_global(KADDR(PTE_ADDR(ent)), level - 1, va);
+	}
+}
+
 // This function returns the physical address of the page containing 'va',
 // defined by the 'pml4e'.  The hardware normally performs
 // this functionality for us!  We define our own version to help check
 // the check_boot_pml4e() function; it shouldn't be used elsewhere.
+// For 2MB and 1GB pages it returns the address of the 4KB frame
+// inside the large page.
 
 	static physaddr_t
 check_va2pa(pml4e_t *pml4e, uintptr_t va)
@@ -779,11 +2307,15 @@ check_va2pa(pml4e_t *pml4e, uintptr_t va)
 	// cprintf(" %x %x " , pdpe, *pdpe);
 	if (!(pdpe[PDPE(va)] & PTE_P))
 		return ~0;
+	if (pdpe[PDPE(va)] & PTE_PS)
+		return PTE_ADDR(pdpe[PDPE(va)]) + (va & (PDPSIZE - 1) & ~(PGSIZE - 1));
 	pde = (pde_t *) KADDR(PTE_ADDR(pdpe[PDPE(va)]));
 	// cprintf(" %x %x " , pde, *pde);
 	pde = &pde[PDX(va)];
 	if (!(*pde & PTE_P))
 		return ~0;
+	if (*pde & PTE_PS)
+		return PTE_ADDR(*pde) + (va & (PTSIZE - 1) & ~(PGSIZE - 1));
 	pte = (pte_t*) KADDR(PTE_ADDR(*pde));
 	// cprintf(" %x %x " , pte, *pte);
 	if (!(pte[PTX(va)] & PTE_P))
@@ -792,13 +2324,60 @@ check_va2pa(pml4e_t *pml4e, uintptr_t va)
 	return PTE_ADDR(pte[PTX(va)]);
 }
 
+// Returns the size of the page that maps 'va' (PGSIZE, PTSIZE or
+// PDPSIZE), or 0 if 'va' is not mapped.
+	static size_t
+check_va2pgsize(pml4e_t *pml4e, uintptr_t va)
+{
+	uint64_t *ent = &pml4e[PML4(va)];
+
+	if (!(*ent & PTE_P))
+		return 0;
+	ent = (uint64_t *) KADDR(PTE_ADDR(*ent)) + PDPE(va);
+	if (!(*ent & PTE_P))
+		return 0;
+	if (*ent & PTE_PS)
+		return PDPSIZE;
+	ent = (uint64_t *) KADDR(PTE_ADDR(*ent)) + PDX(va);
+	if (!(*ent & PTE_P))
+		return 0;
+	if (*ent & PTE_PS)
+		return PTSIZE;
+	ent = (uint64_t *) KADDR(PTE_ADDR(*ent)) + PTX(va);
+	return (*ent & PTE_P) ? PGSIZE : 0;
+}
+
+//
+// Return the entry that maps 'va', large page or not, or 0 if none does.
+//
+static pte_t
+check_va2leaf(pml4e_t *pml4e, uintptr_t va)
+{
+	uint64_t *ent = &pml4e[PML4(va)];
+
+	if (!(*ent & PTE_P))
+		return 0;
+	ent = (uint64_t *) KADDR(PTE_ADDR(*ent)) + PDPE(va);
+	if (!(*ent & PTE_P))
+		return 0;
+	if (*ent & PTE_PS)
+		return *ent;
+	ent = (uint64_t *) KADDR(PTE_ADDR(*ent)) + PDX(va);
+	if (!(*ent & PTE_P))
+		return 0;
+	if (*ent & PTE_PS)
+		return *ent;
+	ent = (uint64_t *) KADDR(PTE_ADDR(*ent)) + PTX(va);
+	return (*ent & PTE_P) ? *ent : 0;
+}
+
 
 // check page_insert, page_remove, &c
 static void
 page_check(void)
 {
 	struct PageInfo *pp0, *pp1, *pp2,*pp3,*pp4,*pp5;
-	struct PageInfo * fl;
+	struct PageInfo *fl[PAGE_MAX_ORDER + 1];
 	pte_t *ptep, *ptep1;
 	pdpe_t *pdpe;
 	pde_t *pde;
@@ -820,8 +2399,7 @@ page_check(void)
 	assert(pp5 && pp5 != pp4 && pp5 != pp3 && pp5 != pp2 && pp5 != pp1 && pp5 != pp0);
 
 	// temporarily steal the rest of the free pages
-	fl = page_free_list;
-	page_free_list = NULL;
+	check_steal_free_lists(fl);
 
 	// should be no free memory
 	assert(!page_alloc(0));
@@ -928,8 +2506,10 @@ page_check(void)
 	assert(pp2->pp_ref == 0);
 #endif
 
-	// forcibly take pp3 back
-	assert(PTE_ADDR(boot_pml4e[0]) == page2pa(pp3));
+	// forcibly take the page tables back.  Which of pp0, pp2 and pp3
+	// became the PDPT depends on how the buddy allocator merged them
+	// when they were freed.
+	assert(PTE_ADDR(boot_pml4e[0]) == page2pa(pp0) || PTE_ADDR(boot_pml4e[0]) == page2pa(pp2) || PTE_ADDR(boot_pml4e[0]) == page2pa(pp3));
 	boot_pml4e[0] = 0;
 	assert(pp3->pp_ref == 1);
     page_decref(pp3);
@@ -944,7 +2524,7 @@ page_check(void)
 	assert(ptep == ptep1 + PTX(va));
 	
     // check that new page tables get cleared
-    page_decref(pp4);
+	page_free(pp4);
 	memset(page2kva(pp4), 0xFF, PGSIZE);
 	pml4e_walk(boot_pml4e, 0x0, 1);
 	pdpe = KADDR(PTE_ADDR(boot_pml4e[0]));
@@ -955,12 +2535,14 @@ page_check(void)
 	boot_pml4e[0] = 0;
 
 	// give free list back
-	page_free_list = fl;
+	check_return_free_lists(fl);
 
-	// free the pages we took
+	// free the page tables the pml4e_walk calls above took (pp1 and
+	// pp4 were already freed), and pp5, which was never used
 	page_decref(pp0);
-	page_decref(pp1);
 	page_decref(pp2);
+	page_decref(pp3);
+	page_free(pp5);
 
 	cprintf("check_page() succeeded!\n");
 }
@@ -13,12 +13,27 @@ extern char bootstacktop[], bootstack[];
 
 extern struct PageInfo *pages;
 extern size_t npages;
+extern bool page_alloc_ready;
+extern physaddr_t maxpa;
+
+// Physical memory is tracked in sections of 2^SECTION_SHIFT pages
+// (128MB).  Only sections holding usable memory get PageInfo entries,
+// stored back to back in 'pages', so holes in the physical address
+// space cost nothing.  section_index maps a physical section number to
+// its slot in 'pages' (-1 if absent); section_ppn maps a slot back to
+// the section's first physical page.
+#define SECTION_SHIFT	15
+#define SECTION_PAGES	(1 << SECTION_SHIFT)
+#define NSECTIONS	4096		// 512GB of physical address space
+
+extern int16_t section_index[NSECTIONS];
+extern ppn_t section_ppn[NSECTIONS];
 
 extern pml4e_t *boot_pml4e;
 
 
 /* This macro takes a kernel virtual address -- an address that points above
- * KERNBASE, where the machine's maximum 256MB of physical memory is mapped --
+ * KERNBASE, where the machine's usable physical memory is mapped --
  * and returns the corresponding physical address.  It panics if you pass it a
  * non-kernel virtual address.
  */
@@ -35,8 +50,7 @@ extern pml4e_t *boot_pml4e;
 #define KADDR(pa)						\
 ({								\
 	physaddr_t __m_pa = (pa);				\
-	uint32_t __m_ppn = PPN(__m_pa);\
-	if (__m_ppn >= npages)					\
+	if (__m_pa >= maxpa)					\
 		panic("KADDR called with invalid pa %08lx", __m_pa);\
 	(void*) ((uint64_t)(__m_pa + KERNBASE));				\
 })
@@ -47,22 +61,74 @@ enum {
 	ALLOC_ZERO = 1<<0,
 };
 
+// Physical pages are managed by a binary buddy allocator.  A block of
+// order k is 2^k physically contiguous pages, aligned to its own size.
+#define PAGE_MAX_ORDER	10	// largest block is 2^10 pages (4MB)
+
+// PageInfo pp_flags bits
+#define PP_FREE		0x01	// heads a free block on page_free_list[pp_order]
+#define PP_CACHED	0x02	// free, parked in a per-CPU page cache
+#define PP_ZEROED	0x04	// free and known zero, on the pre-zeroed list
+
+// Single pages are allocated and freed through a per-CPU cache that
+// holds up to PAGE_CACHE_HIGH pages and trades PAGE_CACHE_BATCH pages
+// at a time with the buddy lists.
+#define PAGE_CACHE_HIGH		64
+#define PAGE_CACHE_BATCH	16
+
+// Number of free pages the monitor keeps zeroed ahead of time for
+// page_alloc(ALLOC_ZERO).
+#define PAGE_ZERO_POOL		128
+
 void    x64_vm_init();
 
 void	page_init(void);
 struct PageInfo * page_alloc(int alloc_flags);
 void	page_free(struct PageInfo *pp);
+struct PageInfo * page_alloc_order(int order, int alloc_flags);
+void	page_free_order(struct PageInfo *pp, int order);
+void	page_cache_drain_all(void);
+int	page_zero_idle(int budget);
+void	page_zero_drain(void);
+void	page_print_stats(void);
 int	page_insert(pml4e_t *pml4e, struct PageInfo *pp, void *va, int perm);
 void	page_remove(pml4e_t *pml4e, void *va);
 struct PageInfo *page_lookup(pml4e_t *pml4e, void *va, pte_t **pte_store);
 void	page_decref(struct PageInfo *pp);
 
 void	tlb_invalidate(pml4e_t *pml4e, void *va);
+void	pmap_load(pml4e_t *pml4e);
+void	pcid_free(pml4e_t *pml4e);
+void	page_remove_range(pml4e_t *pml4e, void *va, size_t size);
+
+// Invalidations collected while tearing down many mappings, so the TLB
+// is flushed once at the end rather than once per page.  Pages whose
+// last mapping went away are only freed after that flush.  Above
+// tlb_flush_threshold pages, reloading CR3 is cheaper than one invlpg
+// per page.  Kernel mappings above ULIM are global and survive a CR3
+// reload, so a gather that touched them flushes with CR4.PGE instead.
+#define TLB_GATHER_MAX	64
+struct TlbGather {
+	pml4e_t *tg_pml4e;	// address space being changed
+	int tg_count;		// pages queued in tg_va/tg_pages
+	bool tg_global;		// some queued address is above ULIM
+	uintptr_t tg_va[TLB_GATHER_MAX];
+	struct PageInfo *tg_pages[TLB_GATHER_MAX];	// to page_decref, or NULL
+};
+
+extern int tlb_flush_threshold;
+
+void	tlb_gather_init(struct TlbGather *tg, pml4e_t *pml4e);
+void	tlb_gather_add(struct TlbGather *tg, void *va, struct PageInfo *pp);
+void	tlb_gather_flush(struct TlbGather *tg);
+void	tlb_print_stats(void);
 
 static inline ppn_t
 page2ppn(struct PageInfo *pp)
 {
-	return pp - pages;
+	size_t i = pp - pages;
+
+	return section_ppn[i >> SECTION_SHIFT] + (i & (SECTION_PAGES - 1));
 }
 
 static inline physaddr_t
@@ -74,9 +140,12 @@ page2pa(struct PageInfo *pp)
 static inline struct PageInfo*
 pa2page(physaddr_t pa)
 {
-	if (PPN(pa) >= npages)
+	ppn_t ppn = PPN(pa);
+	int s;
+
+	if (pa >= maxpa || (s = section_index[ppn >> SECTION_SHIFT]) < 0)
 		panic("pa2page called with invalid pa");
-	return &pages[PPN(pa)];
+	return &pages[((size_t) s << SECTION_SHIFT) + (ppn & (SECTION_PAGES - 1))];
 }
 
 static inline void*
@@ -87,6 +156,26 @@ page2kva(struct PageInfo *pp)
 
 pte_t *pgdir_walk(pde_t *pgdir, const void *va, int create);
 
+// A cursor over one address space's page tables.  It remembers the
+// PDPT, page directory and page table covering the current address, so
+// stepping through a range only descends from the root again when it
+// crosses into a different table.  The cached tables must not be freed
+// while a cursor points into them.
+struct PtCursor {
+	pml4e_t *ptc_pml4e;	// root of the address space
+	uintptr_t ptc_va;	// current address
+	pdpe_t *ptc_pdpe;	// PDPT covering ptc_va, or NULL if not known
+	pde_t *ptc_pgdir;	// page directory covering ptc_va, or NULL
+	pte_t *ptc_pt;		// page table covering ptc_va, or NULL
+};
+
+void	ptc_init(struct PtCursor *c, pml4e_t *pml4e, uintptr_t va);
+void	ptc_advance(struct PtCursor *c, size_t size);
+pte_t  *ptc_walk(struct PtCursor *c, size_t pgsize, int create);
+int	ptc_map(struct PtCursor *c, physaddr_t pa, int perm, size_t pgsize);
+pte_t	ptc_unmap(struct PtCursor *c, struct TlbGather *tg);
+int	ptc_protect(struct PtCursor *c, int perm);
+
 pte_t *pml4e_walk(pml4e_t *pml4e, const void *va, int create);
 
 pde_t *pdpe_walk(pdpe_t *pdpe,const void *va,int create);
@@ -1,28 +1,50 @@
 // Simple implementation of cprintf console output for the kernel,
-// based on printfmt() and the kernel console's cputchar().
+// based on printfmt() and the kernel console's cons_write().
+//
+// vcprintf formats into a 256-byte buffer on the stack and hands the
+// console whole spans.  A cprintf of up to 256 bytes reaches the devices
+// as one write; longer output goes out in 256-byte pieces, and there is
+// no console lock, so anything else printing in between (an interrupt,
+// another CPU) can land between the pieces.
 
 #include <inc/types.h>
 #include <inc/stdio.h>
 #include <inc/stdarg.h>
 
+#include <kern/console.h>
+
+struct printbuf {
+	int idx;	// current buffer index
+	int cnt;	// total bytes printed so far
+	char buf[256];
+};
+
 
 static void
-putch(int ch, int *cnt)
+putch(int ch, struct printbuf *b)
 {
-	cputchar(ch);
-	*cnt++;
+	b->buf[b->idx++] = ch;
+	if (b->idx == sizeof(b->buf)) {
+		cons_write(b->buf, b->idx);
+		b->idx = 0;
+	}
+	b->cnt++;
 }
 
 int
 vcprintf(const char *fmt, va_list ap)
 {
-	int cnt = 0;
+	struct printbuf b;
     va_list aq;
+
+	b.idx = 0;
+	b.cnt = 0;
     va_copy(aq,ap);
-	vprintfmt((void*)putch, &cnt, fmt, aq);
+	vprintfmt((void*)putch, &b, fmt, aq);
     va_end(aq);
-	return cnt;
+	cons_write(b.buf, b.idx);
 
+	return b.cnt;
 }
 
 int
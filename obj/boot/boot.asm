@@ -0,0 +1,391 @@
+
+obj/boot/boot.out:     file format elf32-i386
+
+
+Disassembly of section .text:
+
+00007c00 <start>:
+
+.globl multiboot_info
+.globl start
+start:
+  .code16                     # Assemble for 16-bit mode
+  cli                         # Disable interrupts
+    7c00:	fa                   	cli
+  cld                         # String operations increment
+    7c01:	fc                   	cld
+
+  # Set up the important data segment registers (DS, ES, SS).
+  xorw    %ax,%ax             # Segment number zero
+    7c02:	31 c0                	xor    %eax,%eax
+  movw    %ax,%ds             # -> Data Segment
+    7c04:	8e d8                	mov    %eax,%ds
+  movw    %ax,%es             # -> Extra Segment
+    7c06:	8e c0                	mov    %eax,%es
+  movw    %ax,%ss             # -> Stack Segment
+    7c08:	8e d0                	mov    %eax,%ss
+
+00007c0a <seta20.1>:
+  # Enable A20:
+  #   For backwards compatibility with the earliest PCs, physical
+  #   address line 20 is tied low, so that addresses higher than
+  #   1MB wrap around to zero by default.  This code undoes this.
+seta20.1:
+  inb     $0x64,%al               # Wait for not busy
+    7c0a:	e4 64                	in     $0x64,%al
+  testb   $0x2,%al
+    7c0c:	a8 02                	test   $0x2,%al
+  jnz     seta20.1
+    7c0e:	75 fa                	jne    7c0a <seta20.1>
+
+  movb    $0xd1,%al               # 0xd1 -> port 0x64
+    7c10:	b0 d1                	mov    $0xd1,%al
+  outb    %al,$0x64
+    7c12:	e6 64                	out    %al,$0x64
+
+00007c14 <seta20.2>:
+
+seta20.2:
+  inb     $0x64,%al               # Wait for not busy
+    7c14:	e4 64                	in     $0x64,%al
+  testb   $0x2,%al
+    7c16:	a8 02                	test   $0x2,%al
+  jnz     seta20.2
+    7c18:	75 fa                	jne    7c14 <seta20.2>
+
+  movb    $0xdf,%al               # 0xdf -> port 0x60
+    7c1a:	b0 df                	mov    $0xdf,%al
+  outb    %al,$0x60
+    7c1c:	e6 60                	out    %al,$0x60
+
+00007c1e <do_e820>:
+
+  # get the E820 memory map from the BIOS.  Each entry is preceded by
+  # its size, as multiboot lays them out; %ebp counts the bytes used.
+do_e820:
+  movl $e820_map + 4, %edi
+    7c1e:	66 bf 38 70          	mov    $0x7038,%di
+    7c22:	00 00                	add    %al,(%eax)
+  xorl %ebx, %ebx
+    7c24:	66 31 db             	xor    %bx,%bx
+  xorl %ebp, %ebp
+    7c27:	66 31 ed             	xor    %bp,%bp
+
+00007c2a <next_entry>:
+
+next_entry:
+  movl $0xe820, %eax
+    7c2a:	66 b8 20 e8          	mov    $0xe820,%ax
+    7c2e:	00 00                	add    %al,(%eax)
+  movl $24, %ecx
+    7c30:	66 b9 18 00          	mov    $0x18,%cx
+    7c34:	00 00                	add    %al,(%eax)
+  movl $0x534D4150, %edx
+    7c36:	66 ba 50 41          	mov    $0x4150,%dx
+    7c3a:	4d                   	dec    %ebp
+    7c3b:	53                   	push   %ebx
+  int $0x15
+    7c3c:	cd 15                	int    $0x15
+  jc done
+    7c3e:	72 17                	jb     7c57 <done>
+  cmpl %eax, %edx
+    7c40:	66 39 c2             	cmp    %ax,%dx
+  jne done
+    7c43:	75 12                	jne    7c57 <done>
+  movl %ecx, -4(%edi)
+    7c45:	67 66 89 4f fc       	mov    %cx,-0x4(%bx)
+  addl $24, %edi
+    7c4a:	66 83 c7 18          	add    $0x18,%di
+  addl $24, %ebp
+    7c4e:	66 83 c5 18          	add    $0x18,%bp
+  testl %ebx, %ebx
+    7c52:	66 85 db             	test   %bx,%bx
+  jne next_entry
+    7c55:	75 d3                	jne    7c2a <next_entry>
+
+00007c57 <done>:
+
+done:
+  testl %ebp, %ebp
+    7c57:	66 85 ed             	test   %bp,%bp
+  je failed
+    7c5a:	74 14                	je     7c70 <failed>
+  movw $0x40, (MB_flag) #multiboot info flags
+    7c5c:	c7 06 00 70 40 00    	movl   $0x407000,(%esi)
+  movl $e820_map, (MB_mmap_addr)
+    7c62:	66 c7 06 30 70       	movw   $0x7030,(%esi)
+    7c67:	34 70                	xor    $0x70,%al
+    7c69:	00 00                	add    %al,(%eax)
+  movl %ebp, (MB_mmap_len)
+    7c6b:	66 89 2e             	mov    %bp,(%esi)
+    7c6e:	2c 70                	sub    $0x70,%al
+
+00007c70 <failed>:
+ 
+  # Switch from real to protected mode, using a bootstrap GDT
+  # and segment translation that makes virtual addresses 
+  # identical to their physical addresses, so that the 
+  # effective memory map does not change during the switch.
+  lgdt    gdtdesc
+    7c70:	0f 01 16             	lgdtl  (%esi)
+    7c73:	a4                   	movsb  %ds:(%esi),%es:(%edi)
+    7c74:	7c 0f                	jl     7c85 <protcseg+0x1>
+  movl    %cr0, %eax
+    7c76:	20 c0                	and    %al,%al
+  orl     $CR0_PE_ON, %eax
+    7c78:	66 83 c8 01          	or     $0x1,%ax
+  movl    %eax, %cr0
+    7c7c:	0f 22 c0             	mov    %eax,%cr0
+ 
+  # Jump to next instruction, but in 32-bit code segment.
+  # Switches processor into 32-bit mode.
+  ljmp    $PROT_MODE_CSEG, $protcseg
+    7c7f:	ea                   	.byte 0xea
+    7c80:	84 7c 08 00          	test   %bh,0x0(%eax,%ecx,1)
+
+00007c84 <protcseg>:
+
+  .code32                     # Assemble for 32-bit mode
+protcseg:
+  # Set up the protected-mode data segment registers
+  movw    $PROT_MODE_DSEG, %ax    # Our data segment selector
+    7c84:	66 b8 10 00          	mov    $0x10,%ax
+  movw    %ax, %ds                # -> DS: Data Segment
+    7c88:	8e d8                	mov    %eax,%ds
+  movw    %ax, %es                # -> ES: Extra Segment
+    7c8a:	8e c0                	mov    %eax,%es
+  movw    %ax, %fs                # -> FS
+    7c8c:	8e e0                	mov    %eax,%fs
+  movw    %ax, %gs                # -> GS
+    7c8e:	8e e8                	mov    %eax,%gs
+  movw    %ax, %ss                # -> SS: Stack Segment
+    7c90:	8e d0                	mov    %eax,%ss
+  
+  # Set up the stack pointer and call into C.
+  movl    $start, %esp
+    7c92:	bc 00 7c 00 00       	mov    $0x7c00,%esp
+  movl $multiboot_info, %ebx
+    7c97:	bb 00 70 00 00       	mov    $0x7000,%ebx
+ # call bootmain
+   call bootmain
+    7c9c:	e8 d6 00 00 00       	call   7d77 <bootmain>
+
+00007ca1 <spin>:
+
+  # If bootmain returns (it shouldn't), loop.
+spin:
+  jmp spin
+    7ca1:	eb fe                	jmp    7ca1 <spin>
+    7ca3:	90                   	nop
+
+00007ca4 <gdt>:
+    7ca4:	17                   	pop    %ss
+    7ca5:	00 a4 7c 00 00 00 00 	add    %ah,0x0(%esp,%edi,2)
+    7cac:	ff                   	(bad)
+    7cad:	ff 00                	incl   (%eax)
+    7caf:	00 00                	add    %al,(%eax)
+    7cb1:	9a cf 00 ff ff 00 00 	lcall  $0x0,$0xffff00cf
+    7cb8:	00                   	.byte 0x0
+    7cb9:	92                   	xchg   %eax,%edx
+    7cba:	cf                   	iret
+	...
+
+00007cbc <readseg>:
+
+// Read 'count' bytes at 'offset' from kernel into physical address 'pa'.
+// Might copy more than asked: the whole sectors the bytes are in.
+static void
+readseg(uint32_t pa, uint32_t count, uint32_t offset)
+{
+    7cbc:	55                   	push   %ebp
+    7cbd:	57                   	push   %edi
+    7cbe:	56                   	push   %esi
+    7cbf:	89 c6                	mov    %eax,%esi
+	uint32_t nsect, i;
+
+	// round down to sector boundary
+	pa -= offset % SECTSIZE;
+    7cc1:	89 c8                	mov    %ecx,%eax
+{
+    7cc3:	53                   	push   %ebx
+	pa -= offset % SECTSIZE;
+    7cc4:	25 ff 01 00 00       	and    $0x1ff,%eax
+{
+    7cc9:	53                   	push   %ebx
+	pa -= offset % SECTSIZE;
+    7cca:	29 c6                	sub    %eax,%esi
+{
+    7ccc:	89 cb                	mov    %ecx,%ebx
+	nsect = (offset % SECTSIZE + count + SECTSIZE - 1) / SECTSIZE;
+    7cce:	8d 84 10 ff 01 00 00 	lea    0x1ff(%eax,%edx,1),%eax
+    7cd5:	c1 e8 09             	shr    $0x9,%eax
+
+	// translate from bytes to sectors, and kernel starts at sector 1
+	offset = (offset / SECTSIZE) + 1;
+    7cd8:	c1 eb 09             	shr    $0x9,%ebx
+	nsect = (offset % SECTSIZE + count + SECTSIZE - 1) / SECTSIZE;
+    7cdb:	89 c5                	mov    %eax,%ebp
+	offset = (offset / SECTSIZE) + 1;
+    7cdd:	43                   	inc    %ebx
+	pa -= offset % SECTSIZE;
+    7cde:	89 34 24             	mov    %esi,(%esp)
+
+	for (i = 0; i < nsect; i++) {
+    7ce1:	31 f6                	xor    %esi,%esi
+    7ce3:	39 ee                	cmp    %ebp,%esi
+    7ce5:	0f 84 86 00 00 00    	je     7d71 <readseg+0xb5>
+		// One command asks for the next MAXSECT sectors, or the rest.
+		if (i % MAXSECT == 0) {
+    7ceb:	89 f0                	mov    %esi,%eax
+    7ced:	84 c0                	test   %al,%al
+    7cef:	75 55                	jne    7d46 <readseg+0x8a>
+
+static __inline uint8_t
+inb(int port)
+{
+	uint8_t data;
+	__asm __volatile("inb %w1,%0" : "=a" (data) : "d" (port));
+    7cf1:	ba f7 01 00 00       	mov    $0x1f7,%edx
+    7cf6:	ec                   	in     (%dx),%al
+
+static void
+waitdisk(void)
+{
+	// wait for disk reaady
+	while ((inb(0x1F7) & 0xC0) != 0x40)
+    7cf7:	83 e0 c0             	and    $0xffffffc0,%eax
+    7cfa:	3c 40                	cmp    $0x40,%al
+    7cfc:	75 f3                	jne    7cf1 <readseg+0x35>
+			outb(0x1F2, MIN(nsect - i, MAXSECT));	// 256 is 0
+    7cfe:	89 e8                	mov    %ebp,%eax
+    7d00:	ba 00 01 00 00       	mov    $0x100,%edx
+    7d05:	29 f0                	sub    %esi,%eax
+    7d07:	39 d0                	cmp    %edx,%eax
+    7d09:	0f 47 c2             	cmova  %edx,%eax
+}
+
+static __inline void
+outb(int port, uint8_t data)
+{
+	__asm __volatile("outb %0,%w1" : : "a" (data), "d" (port));
+    7d0c:	ba f2 01 00 00       	mov    $0x1f2,%edx
+    7d11:	ee                   	out    %al,(%dx)
+    7d12:	ba f3 01 00 00       	mov    $0x1f3,%edx
+    7d17:	89 d8                	mov    %ebx,%eax
+    7d19:	ee                   	out    %al,(%dx)
+			outb(0x1F4, offset >> 8);
+    7d1a:	89 d8                	mov    %ebx,%eax
+    7d1c:	ba f4 01 00 00       	mov    $0x1f4,%edx
+    7d21:	c1 e8 08             	shr    $0x8,%eax
+    7d24:	ee                   	out    %al,(%dx)
+			outb(0x1F5, offset >> 16);
+    7d25:	89 d8                	mov    %ebx,%eax
+    7d27:	ba f5 01 00 00       	mov    $0x1f5,%edx
+    7d2c:	c1 e8 10             	shr    $0x10,%eax
+    7d2f:	ee                   	out    %al,(%dx)
+			outb(0x1F6, (offset >> 24) | 0xE0);
+    7d30:	89 d8                	mov    %ebx,%eax
+    7d32:	ba f6 01 00 00       	mov    $0x1f6,%edx
+    7d37:	c1 e8 18             	shr    $0x18,%eax
+    7d3a:	83 c8 e0             	or     $0xffffffe0,%eax
+    7d3d:	ee                   	out    %al,(%dx)
+    7d3e:	b0 20                	mov    $0x20,%al
+    7d40:	ba f7 01 00 00       	mov    $0x1f7,%edx
+    7d45:	ee                   	out    %al,(%dx)
+	__asm __volatile("inb %w1,%0" : "=a" (data) : "d" (port));
+    7d46:	ba f7 01 00 00       	mov    $0x1f7,%edx
+    7d4b:	ec                   	in     (%dx),%al
+		while ((inb(0x1F7) & 0x88) != 0x08)
+    7d4c:	83 e0 88             	and    $0xffffff88,%eax
+    7d4f:	3c 08                	cmp    $0x8,%al
+    7d51:	75 f3                	jne    7d46 <readseg+0x8a>
+	__asm __volatile("cld\n\trepne\n\tinsl"			:
+    7d53:	8b 3c 24             	mov    (%esp),%edi
+    7d56:	b9 80 00 00 00       	mov    $0x80,%ecx
+    7d5b:	ba f0 01 00 00       	mov    $0x1f0,%edx
+    7d60:	fc                   	cld
+    7d61:	f2 6d                	repnz insl (%dx),%es:(%edi)
+		pa += SECTSIZE;
+    7d63:	81 04 24 00 02 00 00 	addl   $0x200,(%esp)
+		offset++;
+    7d6a:	43                   	inc    %ebx
+	for (i = 0; i < nsect; i++) {
+    7d6b:	46                   	inc    %esi
+    7d6c:	e9 72 ff ff ff       	jmp    7ce3 <readseg+0x27>
+}
+    7d71:	58                   	pop    %eax
+    7d72:	5b                   	pop    %ebx
+    7d73:	5e                   	pop    %esi
+    7d74:	5f                   	pop    %edi
+    7d75:	5d                   	pop    %ebp
+    7d76:	c3                   	ret
+
+00007d77 <bootmain>:
+{
+    7d77:	57                   	push   %edi
+	readseg((uint32_t) ELFHDR, SECTSIZE*8, 0);
+    7d78:	31 c9                	xor    %ecx,%ecx
+    7d7a:	ba 00 10 00 00       	mov    $0x1000,%edx
+    7d7f:	b8 00 00 01 00       	mov    $0x10000,%eax
+{
+    7d84:	56                   	push   %esi
+    7d85:	53                   	push   %ebx
+	readseg((uint32_t) ELFHDR, SECTSIZE*8, 0);
+    7d86:	e8 31 ff ff ff       	call   7cbc <readseg>
+	if (ELFHDR->e_magic != ELF_MAGIC)
+    7d8b:	81 3d 00 00 01 00 7f 	cmpl   $0x464c457f,0x10000
+    7d92:	45 4c 46 
+    7d95:	75 4d                	jne    7de4 <bootmain+0x6d>
+	eph = ph + ELFHDR->e_phnum;
+    7d97:	0f b7 35 38 00 01 00 	movzwl 0x10038,%esi
+	ph = (struct Proghdr *) ((uint8_t *) ELFHDR + ELFHDR->e_phoff);
+    7d9e:	a1 20 00 01 00       	mov    0x10020,%eax
+	eph = ph + ELFHDR->e_phnum;
+    7da3:	6b f6 38             	imul   $0x38,%esi,%esi
+	ph = (struct Proghdr *) ((uint8_t *) ELFHDR + ELFHDR->e_phoff);
+    7da6:	8d 98 00 00 01 00    	lea    0x10000(%eax),%ebx
+	eph = ph + ELFHDR->e_phnum;
+    7dac:	01 de                	add    %ebx,%esi
+	for (; ph < eph; ph++) {
+    7dae:	39 f3                	cmp    %esi,%ebx
+    7db0:	73 25                	jae    7dd7 <bootmain+0x60>
+		readseg(ph->p_pa, ph->p_filesz, ph->p_offset);
+    7db2:	8b 4b 08             	mov    0x8(%ebx),%ecx
+    7db5:	8b 43 18             	mov    0x18(%ebx),%eax
+    7db8:	8b 53 20             	mov    0x20(%ebx),%edx
+    7dbb:	e8 fc fe ff ff       	call   7cbc <readseg>
+		      ph->p_memsz - ph->p_filesz);
+    7dc0:	8b 43 20             	mov    0x20(%ebx),%eax
+		stosb((void *) (uint32_t) (ph->p_pa + ph->p_filesz), 0,
+    7dc3:	8b 7b 18             	mov    0x18(%ebx),%edi
+		      ph->p_memsz - ph->p_filesz);
+    7dc6:	8b 4b 28             	mov    0x28(%ebx),%ecx
+		stosb((void *) (uint32_t) (ph->p_pa + ph->p_filesz), 0,
+    7dc9:	01 c7                	add    %eax,%edi
+		      ph->p_memsz - ph->p_filesz);
+    7dcb:	29 c1                	sub    %eax,%ecx
+	__asm __volatile("cld\n\trepne\n\tstosb"		:
+    7dcd:	31 c0                	xor    %eax,%eax
+    7dcf:	fc                   	cld
+    7dd0:	f2 aa                	repnz stos %al,%es:(%edi)
+	for (; ph < eph; ph++) {
+    7dd2:	83 c3 38             	add    $0x38,%ebx
+    7dd5:	eb d7                	jmp    7dae <bootmain+0x37>
+    __asm __volatile("movl %0, %%ebx": : "r" (multiboot_info));
+    7dd7:	b8 00 70 00 00       	mov    $0x7000,%eax
+    7ddc:	89 c3                	mov    %eax,%ebx
+	((void (*)(void)) ((uint32_t)(ELFHDR->e_entry)))();
+    7dde:	ff 15 18 00 01 00    	call   *0x10018
+}
+
+static __inline void
+outw(int port, uint16_t data)
+{
+	__asm __volatile("outw %0,%w1" : : "a" (data), "d" (port));
+    7de4:	ba 00 8a 00 00       	mov    $0x8a00,%edx
+    7de9:	b8 00 8a ff ff       	mov    $0xffff8a00,%eax
+    7dee:	66 ef                	out    %ax,(%dx)
+    7df0:	b8 00 8e ff ff       	mov    $0xffff8e00,%eax
+    7df5:	66 ef                	out    %ax,(%dx)
+	while (1)
+    7df7:	eb fe                	jmp    7df7 <bootmain+0x80>